@@ -1,4 +1,7 @@
 #include "LocalFreeList.h"
+#include "global.h"
+#include "tree.h"
+#include <algorithm>
 #include <cstring>
 
 #ifdef SP_TEST
@@ -23,49 +26,176 @@ insert_from_stack(local::PoolsRAII &pool, LocalFree *stack) noexcept;
 static bool
 merge_stack(local::PoolsRAII &pool) noexcept;
 
+// The nodes of the free list are indexed by two AVL trees, by address to find
+// the neighbours of a node to coalesce with and by [size, address] to find the
+// best fit of an allocation without walking the free list.
+struct FreeByAddress {
+  static LocalFree *&
+  left(LocalFree *f) noexcept {
+    return f->left;
+  }
+  static LocalFree *&
+  right(LocalFree *f) noexcept {
+    return f->right;
+  }
+  static std::uint8_t &
+  height(LocalFree *f) noexcept {
+    return f->height;
+  }
+  static bool
+  less(const LocalFree *a, const LocalFree *b) noexcept {
+    return a < b;
+  }
+};
+
+struct FreeBySize {
+  static LocalFree *&
+  left(LocalFree *f) noexcept {
+    return f->size_left;
+  }
+  static LocalFree *&
+  right(LocalFree *f) noexcept {
+    return f->size_right;
+  }
+  static std::uint8_t &
+  height(LocalFree *f) noexcept {
+    return f->size_height;
+  }
+  static bool
+  less(const LocalFree *a, const LocalFree *b) noexcept {
+    if (a->size != b->size) {
+      return a->size < b->size;
+    }
+    return a < b;
+  }
+};
+
+static void
+free_insert(local::PoolsRAII &pool, LocalFree *const free) noexcept {
+  pool.free_tree.next =
+      tree::insert<LocalFree, FreeByAddress>(pool.free_tree.next, free);
+  pool.free_size = tree::insert<LocalFree, FreeBySize>(pool.free_size, free);
+} // local::free_insert()
+
+static void
+free_remove(local::PoolsRAII &pool, LocalFree *const free) noexcept {
+  pool.free_tree.next =
+      tree::remove<LocalFree, FreeByAddress>(pool.free_tree.next, free);
+  pool.free_size = tree::remove<LocalFree, FreeBySize>(pool.free_size, free);
+} // local::free_remove()
+
+static std::uintptr_t
+aligned_start(LocalFree *const node, sp::node_size search,
+              std::size_t alignment) noexcept {
+  // place the allocation as high up in @node as possible, this leave the
+  // LocalFree header of the remaining prefix in place. When there is no room
+  // for a prefix the allocation starts at @node and only a suffix remains.
+  const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(node);
+  const std::uintptr_t end = start + std::size_t(node->size);
+  if (end - start < std::size_t(search)) {
+    return 0;
+  }
+  std::uintptr_t result = (end - std::size_t(search)) & ~(alignment - 1);
+  if (result < start) {
+    return 0;
+  }
+  const std::size_t suffix = end - (result + std::size_t(search));
+  if (suffix > 0 && suffix < sizeof(LocalFree)) {
+    // the tail is to small to be tracked as a LocalFree
+    if (result - start < alignment) {
+      return 0;
+    }
+    result -= alignment;
+  }
+  return result;
+} // local::aligned_start()
+
 //==PUBLIC=================================================================
 void *
-alloc(local::PoolsRAII &pool, sp::node_size search) noexcept {
+alloc(local::PoolsRAII &pool, sp::node_size search,
+      std::size_t alignment) noexcept {
   if (search == 0) {
     return nullptr;
   }
+  assert(util::is_power_of_two(alignment));
 
 Lstart:
-  LocalFree *best = nullptr;
-  LocalFree *const start = &pool.free_list;
-  assert(start);
-  LocalFree *current = start;
+  // the smallest range of at least @search bytes
+  LocalFree *current = tree::lower_bound<LocalFree, FreeBySize>(
+      pool.free_size, [search](const LocalFree *f) { //
+        return f->size < search;
+      });
 
 Lnext:
-  if (current->size == search) {
-    list::unlist(current);
+  if (current) {
+    const std::uintptr_t raw = reinterpret_cast<std::uintptr_t>(current);
+    const std::uintptr_t candidate = aligned_start(current, search, alignment);
+    if (candidate == raw) {
+      const std::uintptr_t end = raw + std::size_t(current->size);
+      const std::uintptr_t tail = raw + std::size_t(search);
+
+      // [result:search][suffix]
+      list::unlist(current);
+      free_remove(pool, current);
+      pool.free_bytes -= end - raw;
+      if (tail != end) {
+        LocalFree *const suffix = header::init_local_free(
+            reinterpret_cast<void *>(tail), sp::node_size(end - tail));
+        dealloc(pool, suffix, suffix);
+      }
 
 #ifdef SP_TEST
-    std::memset(current, 0, std::size_t(current->size));
+      std::memset(current, 0, std::size_t(search));
 #endif
-    return current;
-  } else if (current->size > search) {
-    if (!best || best->size > current->size) {
-      best = current;
+      return current;
     }
-  }
 
-  current = current->next;
-  if (current != start) {
-    goto Lnext;
-  } else {
-    if (best) {
-      return header::reduce(best, search);
-    }
+    if (candidate > raw && candidate - raw >= sizeof(LocalFree)) {
+      const std::uintptr_t end = raw + std::size_t(current->size);
+      const std::uintptr_t tail = candidate + std::size_t(search);
+
+      // [current:prefix][result:search][suffix]
+      // the address of current is unchanged, only its size
+      pool.free_size =
+          tree::remove<LocalFree, FreeBySize>(pool.free_size, current);
+      current->size = sp::node_size(candidate - raw);
+      pool.free_size =
+          tree::insert<LocalFree, FreeBySize>(pool.free_size, current);
+      // the suffix is accounted for again when it is merged from the stack
+      pool.free_bytes -= end - candidate;
+
+      void *const result = reinterpret_cast<void *>(candidate);
+      if (tail != end) {
+        LocalFree *const suffix = header::init_local_free(
+            reinterpret_cast<void *>(tail), sp::node_size(end - tail));
+        dealloc(pool, suffix, suffix);
+      }
 
-    if (merge_stack(pool)) {
-      // XXX make better
-      goto Lstart;
+#ifdef SP_TEST
+      std::memset(result, 0, std::size_t(search));
+#endif
+      return result;
     }
+
+    // @alignment does not fit in current, try the next larger range
+    current = tree::lower_bound<LocalFree, FreeBySize>(
+        pool.free_size, [current](const LocalFree *f) { //
+          return !FreeBySize::less(current, f);
+        });
+    goto Lnext;
+  }
+
+  if (merge_stack(pool)) {
+    goto Lstart;
   }
   return nullptr;
 } // local::alloc()
 
+void *
+alloc(local::PoolsRAII &pool, sp::node_size search) noexcept {
+  return alloc(pool, search, alignof(LocalFree));
+} // local::alloc()
+
 void
 dealloc(local::PoolsRAII &ps, LocalFree *first, LocalFree *last) noexcept {
   // TODO how to handle only one LocalFree* dealloc
@@ -77,20 +207,72 @@ dealloc(local::PoolsRAII &ps, LocalFree *first, LocalFree *last) noexcept {
     // TODO assert first->...next == last
   }
 #endif
-  sp::SharedLock guard{ps.free_lock};
-  if (guard) {
-    // Not a doubly linked list when in the free stack
-    auto base = ps.free_stack.load();
-  retry:
-    last->next = base;
-    if (!ps.free_stack.compare_exchange_weak(base, first)) {
-      goto retry;
-    }
-  } else {
-    // TODO handle dealloc-alloc contention should probably just retry
-    assert(false);
+  // Not a doubly linked list when in the free stack. The stack is only ever
+  // drained as a whole with exchange() so a node can not be popped and pushed
+  // again between the load and the cas, there is no ABA to guard against.
+  auto base = ps.free_stack.load(std::memory_order_relaxed);
+retry:
+  last->next = base;
+  if (!ps.free_stack.compare_exchange_weak(base, first,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+    goto retry;
   }
 } // local::dealloc()
+
+std::size_t
+trim(global::State &global, local::PoolsRAII &pool) noexcept {
+  merge_stack(pool);
+
+  const std::size_t live = pool.total_alloc.load();
+  const std::size_t high = std::max(
+      SP_MALLOC_FREE_HIGH_MIN, (live / 100) * SP_MALLOC_FREE_HIGH_PERCENT);
+  if (pool.free_bytes <= high) {
+    return 0;
+  }
+  const std::size_t low = high / 2;
+
+  std::size_t result(0);
+Lnext:
+  if (pool.free_bytes > low) {
+    // the largest range, it is the one most likely to coalesce in global
+    LocalFree *const current = tree::last_before<LocalFree, FreeBySize>(
+        pool.free_size, [](const LocalFree *) { return true; });
+    assert(current);
+
+    const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(current);
+    const std::size_t size(current->size);
+    if (start % SP_MALLOC_PAGE_SIZE != 0 || size % SP_MALLOC_PAGE_SIZE != 0) {
+      // global only deals in whole pages
+      return result;
+    }
+
+    std::size_t length =
+        util::round_up(pool.free_bytes - low, SP_MALLOC_PAGE_SIZE);
+    void *release = current;
+    if (length >= size) {
+      length = size;
+      list::unlist(current);
+      free_remove(pool, current);
+    } else {
+      // [current:keep][release:length]
+      pool.free_size =
+          tree::remove<LocalFree, FreeBySize>(pool.free_size, current);
+      current->size = sp::node_size(size - length);
+      pool.free_size =
+          tree::insert<LocalFree, FreeBySize>(pool.free_size, current);
+      release = reinterpret_cast<void *>(start + (size - length));
+    }
+
+    pool.free_bytes -= length;
+    result += length;
+    global::dealloc(global, release,
+                    sp::pages(length >> SP_MALLOC_PAGE_SHIFT));
+    goto Lnext;
+  }
+
+  return result;
+} // local::trim()
 } // namespace local
 
 //==PRIVATE=================================================================
@@ -144,300 +326,72 @@ unlist(header::LocalFree *node) noexcept {
 
 namespace local {
 
-static LocalFree *
-merge_if_n(LocalFree *it) noexcept {
-  assert(it);
-  if (it->left) {
-    if (is_consecutive(it->left, it)) {
-      // assert(false);
-      assert(it->left->right == nullptr);
-
-      list::unlist(it->left);
-      {
-        LocalFree *const left = it->left->left;
-        LocalFree *const right = it->right;
-        {
-          LocalFree *const priv = it->priv;
-          LocalFree *const next = it->next;
-          it = header::init_local_free(it->left, it->left->size + it->size);
-          list::relink(it, priv, next);
-        }
-        it->left = left;
-        it->right = right;
-      }
-    }
-  }
-  if (it->right) {
-    if (is_consecutive(it, it->right)) {
-      assert(it->right->left == nullptr);
-
-      list::unlist(it->right);
-      {
-        LocalFree *const left = it->left;
-        LocalFree *const right = it->right->right;
-        {
-          LocalFree *const priv = it->priv;
-          LocalFree *const next = it->next;
-          it = header::init_local_free(it, it->size + it->right->size);
-          list::relink(it, priv, next);
-        }
-        it->left = left;
-        it->right = right;
-      }
-    }
-  }
-  return it;
-}
-
-static LocalFree *
-insert_node(LocalFree *root, LocalFree *node, bool &merged) noexcept {
+static void
+insert_node(local::PoolsRAII &pool, LocalFree *node) noexcept {
   assert(node);
 
   assert(node->next == nullptr);
   assert(node->priv == nullptr);
 
-  assert(node->left == nullptr);
-  assert(node->right == nullptr);
-
-  if (root == nullptr) {
-    merged = false;
-    return node;
-  }
-
-  assert(root);
-  assert(root->next != nullptr);
-  assert(root->priv != nullptr);
-
-  auto update_it = [&root](LocalFree **parent, bool is_left,
-                           LocalFree *subject) {
-    if (!parent) {
-      root = subject;
-    } else if (is_left) {
-      (*parent)->left = subject;
-    } else {
-      (*parent)->right = subject;
+  pool.free_bytes += std::size_t(node->size);
+
+  LocalFree *const root = pool.free_tree.next;
+  // [priv][node][next]
+  auto before = [node](const LocalFree *f) { return f < node; };
+  LocalFree *const priv =
+      tree::last_before<LocalFree, FreeByAddress>(root, before);
+  LocalFree *const next =
+      tree::lower_bound<LocalFree, FreeByAddress>(root, before);
+
+  if (priv && is_consecutive(priv, node)) {
+    // the address of priv is unchanged so it keeps its place in the address
+    // tree, only its place in the size tree changes
+    pool.free_size = tree::remove<LocalFree, FreeBySize>(pool.free_size, priv);
+    priv->size = priv->size + node->size;
+
+    if (next && is_consecutive(priv, next)) {
+      free_remove(pool, next);
+      list::unlist(next);
+      priv->size = priv->size + next->size;
     }
+    pool.free_size = tree::insert<LocalFree, FreeBySize>(pool.free_size, priv);
     return;
-  };
-
-  // if /it/ is left or right from parent
-  bool is_left = false;
-  LocalFree **parent = nullptr;
-  LocalFree *it = root;
-Lstart:
-  /*
-   * this part does not change the order of nodes it just merges the new node
-   * into an existing thusly requiring no rebalancing.
-   */
-  if (is_consecutive(it, node)) {
-    // printf("is_consecutive(it, node)\n");
-    // merge [it][node]
-    it->size = it->size + node->size;
-    merged = true;
-
-    {
-      LocalFree *right = it->right;
-      if (right && is_consecutive(it, right)) {
-        // printf("is_consecutive(it, right)\n");
-        assert(right->left == nullptr);
-        list::unlist(right);
-
-        // merge [it][it->right]
-        it->size = it->size + right->size;
-        it->right = right->right;
-      }
-    }
-
-    // TODO recursively merge upwards until no longer adjacent
-    // TODO maybe automaticly merge when travesing the tree
-    if (parent && is_consecutive(it, *parent)) {
-      // printf("is_consecutive(it, *parent)\n");
-      assert(it->right == nullptr);
-      assert((*parent)->left == it);
-      // printf("parent-left\n");
-
-      list::unlist(it);
-      {
-        LocalFree *right = (*parent)->right;
-        LocalFree *left = it->left;
-
-        // merge [it]<-[parent]->null
-        {
-          LocalFree *priv = (*parent)->priv;
-          LocalFree *next = (*parent)->next;
-          *parent = header::init_local_free(it, it->size + (*parent)->size);
-          list::relink(*parent, priv, next);
-        }
-        (*parent)->left = left;
-        (*parent)->right = right;
-      }
-    }
-    // assert(!parent || !is_consecutive(*parent, it));
-
-    assert(root->next != nullptr);
-    assert(root->priv != nullptr);
-
-    return root;
-  }
-
-  if (is_consecutive(node, it)) {
-    // printf("is_consecutive(node, it)\n");
-    LocalFree *new_left = it->left;
-    LocalFree *new_right = it->right;
-
-    LocalFree *old_left = it->left;
-    LocalFree *old_right = it->right;
-
-    {
-      // merge [node][it]
-      LocalFree *priv = it->priv;
-      LocalFree *next = it->next;
-      node = header::init_local_free(node, node->size + it->size);
-      list::relink(node, priv, next);
-
-      update_it(parent, is_left, node);
-    }
-
-    if (old_left && is_consecutive(old_left, node)) {
-      assert(old_left->right == nullptr);
-      // assert(left->left == it);
-      list::unlist(node);
-      new_left = old_left->left;
-
-      {
-        // merge [left][it]
-        LocalFree *priv = old_left->priv;
-        LocalFree *next = old_left->next;
-        node = header::init_local_free(old_left, old_left->size + node->size);
-        assert(node == old_left);
-        list::relink(node, priv, next);
-        update_it(parent, is_left, node);
-      }
-    }
-
-    if (parent && is_consecutive(*parent, node)) {
-      assert(new_left == nullptr);
-      assert((*parent)->right == node);
-
-      list::unlist(node);
-      new_left = (*parent)->left;
-
-      // merge [parent][it]
-      LocalFree *priv = (*parent)->priv;
-      LocalFree *next = (*parent)->next;
-      node = header::init_local_free(*parent, (*parent)->size + node->size);
-      list::relink(node, priv, next);
-      assert(node == *parent);
-    }
-
-    {
-      node->left = new_left;
-      assert(node->left == nullptr || node->left < node);
-      node->right = new_right;
-      assert(node->right == nullptr || node->right > node);
-    }
-
-    assert(root->next != nullptr);
-    assert(root->priv != nullptr);
-
-    merged = true;
-    return root;
   }
-  /*TODO this part should be rebalanced*/
-  {
-    it = merge_if_n(it);
-    update_it(parent, is_left, it);
-
-    if (!parent) {
-      parent = &root;
-    } else if (is_left) {
-      parent = &((*parent)->left);
-    } else {
-      parent = &((*parent)->right);
-    }
 
-    if (node > it) {
-      if (it->right) {
-        is_left = false;
-        it = it->right;
-        goto Lstart;
-      } else {
-        it->right = node;
-      }
-    } else {
-      if (it->left) {
-        is_left = true;
-        it = it->left;
-        goto Lstart;
-      } else {
-        it->left = node;
-      }
-    }
+  if (next && is_consecutive(node, next)) {
+    // node takes the place of next in the list
+    free_remove(pool, next);
+    LocalFree *const list_priv = next->priv;
+    LocalFree *const list_next = next->next;
+    node->size = node->size + next->size;
+    list::relink(node, list_priv, list_next);
+  } else {
+    pool.free_list.next = list::enlist(node, pool.free_list.next);
   }
 
-  assert(root->next != nullptr);
-  assert(root->priv != nullptr);
-
-  merged = false;
-  return root;
-}
+  free_insert(pool, node);
+} // local::insert_node()
 
 static void
 insert_from_stack(local::PoolsRAII &pool, LocalFree *stack) noexcept {
-  LocalFree *tree = pool.free_tree.next;
 Lstart:
   if (stack) {
-    assert(stack != nullptr);
-
     LocalFree *next = stack->next;
     stack->next = nullptr;
-    // TODO readd
-    // if (next && header::is_consecutive(stack, next)) {
-    //   stack =
-    //       header::init_local_free(stack, stack->size + next->size,
-    //       next->next);
-    //   next = stack->next;
-    //   goto Lstart;
-    // }
-    // if (next && header::is_consecutive(next, stack)) {
-    //   stack =
-    //       header::init_local_free(next, next->size + stack->size,
-    //       next->next);
-    //   next = stack->next;
-    //   goto Lstart;
-    // }
-
-    bool merged = false;
-    tree = insert_node(tree, stack, merged);
-    if (!merged) {
-      pool.free_list.next = list::enlist(stack, pool.free_list.next);
-    }
+
+    insert_node(pool, stack);
 
     stack = next;
     goto Lstart;
   }
-  pool.free_tree.next = tree;
-}
+} // local::insert_from_stack()
 
 static bool
 merge_stack(local::PoolsRAII &pool) noexcept {
-  auto stack = pool.free_stack.load();
+  LocalFree *stack = pool.free_stack.load(std::memory_order_relaxed);
   if (stack) {
-    // TODO
-    // Maybe prepare lock is enough here because only one thread can hold the
-    // prepare lock at one time and it does not hinder concurrent shared locks.
-    // The only purpose of the lock here is to avoid the ABA concurrency
-    // problem when swapping free stack head. Write a stress test X threads cas
-    // dequeue then case insert again one by one.
-    sp::EagerExclusiveLock guard{pool.free_lock};
-    if (guard) {
-    retry:
-      if (stack) {
-        if (!pool.free_stack.compare_exchange_weak(stack, nullptr)) {
-          goto retry;
-        }
-      }
-    }
+    // take the whole stack, concurrent local::dealloc() push onto the empty one
+    stack = pool.free_stack.exchange(nullptr, std::memory_order_acquire);
   }
 
   if (stack) {
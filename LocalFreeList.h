@@ -7,9 +7,24 @@ namespace local {
 void *
 alloc(local::PoolsRAII &, sp::node_size) noexcept;
 
+/* Allocate @length bytes aligned to @alignment, the unused head and tail of
+ * the LocalFree block is kept in the free list.
+ */
+void *
+alloc(local::PoolsRAII &, sp::node_size, std::size_t alignment) noexcept;
+
 void
 dealloc(local::PoolsRAII &, header::LocalFree *first,
         header::LocalFree *last) noexcept;
+
+/* When the free list of @pool holds more than its high watermark the largest
+ * ranges are returned to @global until it is down to the low watermark. Must
+ * only be called by the thread owning @pool.
+ *
+ * @return            the number of bytes returned to @global
+ */
+std::size_t
+trim(global::State &, local::PoolsRAII &) noexcept;
 }
 
 #endif
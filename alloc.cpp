@@ -5,18 +5,22 @@
 
 #include "LocalFreeList.h"
 #include "bitset/Bitset.h"
+#include "free.h"
 #include "global.h"
+#include "pagemap.h"
 #include <concurrent/ReadWriteLock.h>
 #include <cstring>
 
 //============================================================
 static void *
-alloc(global::State &global, local::PoolsRAII &pools,
-      sp::node_size sz) noexcept {
-  void *result = local::alloc(pools, sz);
+alloc(global::State &global, local::PoolsRAII &pools, sp::node_size sz,
+      std::size_t alignment) noexcept {
+  void *result = local::alloc(pools, sz, alignment);
   if (!result) {
     // TODO logic to allocate extra memory for locall::FreeList
-    result = global::alloc(global, sz);
+    assert(std::size_t(sz) % SP_MALLOC_PAGE_SIZE == 0);
+    const sp::pages pages(std::size_t(sz) >> SP_MALLOC_PAGE_SHIFT);
+    result = global::alloc(global, pages, alignment);
   }
   if (result) {
     pools.total_alloc.fetch_add(std::size_t(sz));
@@ -32,44 +36,16 @@ next_node(header::Node *const start) noexcept {
 static void *
 pointer_at(header::Node *start, sp::index index) noexcept {
   // Pool[Extent[Node[nodeHDR,extHDR],Node[nodeHDR]...]...]
-  // The first NodeHeader in the extent contains data while intermediate
-  // NodeHeader does not containt this data.
+  // An extent is a single contiguous HEAD Node so the bucket is found with
+  // the same arithmetic as header::bucket_index().
   assert(start->type == header::NodeType::HEAD);
-  std::size_t header_size(header::SIZE);
-  sp::buckets buckets = start->buckets;
-  const sp::bucket_size bucket_size = start->bucket_size;
-node_start:
-  const sp::node_size node_size = start->node_size;
-  const sp::node_size data_area_size(node_size - header_size);
-
-  sp::buckets nodeBuckets =
-      std::min(data_area_size / start->bucket_size, buckets);
-  if (index < nodeBuckets) {
-    // the index is in range of current node
-    uintptr_t startPtr = reinterpret_cast<uintptr_t>(start);
-    uintptr_t data_start = startPtr + header_size;
-
-    return reinterpret_cast<void *>(data_start + (index * bucket_size));
-  }
-  // the index is out of range, go to next node
-
-  header::Node *const next = next_node(start);
-  index = index - nodeBuckets;
-  buckets = buckets - nodeBuckets;
+  assert(index < start->buckets);
+  assert(header::node_data_start(start) +
+             std::size_t(start->buckets) * std::size_t(start->bucket_size) <=
+         reinterpret_cast<std::uintptr_t>(start) +
+             std::size_t(start->node_size));
 
-  if (buckets > 0) {
-    assert(next != nullptr);
-    assert(next->type == header::NodeType::LINK);
-
-    start = next;
-    // the same extent but a new node
-    header_size = sizeof(header::Node);
-    goto node_start;
-  } else {
-    // out of bound
-    // TODO implementation fault or runtime?
-    assert(false);
-  }
+  return header::bucket_at(start, index);
 } // ::pointer_at()
 
 static header::Node *
@@ -103,47 +79,45 @@ reserve(header::Node *const node) noexcept {
   return nullptr;
 } // ::reserve()
 
-static sp::node_size
-calc_min_node(sp::bucket_size bucketSz) noexcept {
-  assert(bucketSz >= 8);
-  assert(bucketSz % 8 == 0);
-
-  constexpr sp::node_size min_alloc(SP_MALLOC_PAGE_SIZE);
-  constexpr sp::node_size max_alloc(min_alloc * 4);
+static header::Node *
+reuse_extent(local::PoolsRAII &pools, local::Pool &pool) noexcept {
+  header::Node *const result = pool.empty;
+  if (result) {
+    assert(header::is_empty(header::extent(result)));
+    pool.empty = result->next.load();
+    --pool.empty_length;
 
-  const sp::bucket_size atLeast(bucketSz + header::SIZE);
-  if (atLeast > max_alloc) {
-    return sp::node_size{
-        util::round_up(std::size_t(atLeast), std::size_t(min_alloc))};
+    // the header is intact, only the link and the page map entries that was
+    // removed when the extent was unlinked needs to be restored
+    result->next.store(nullptr);
+#ifdef SP_TEST
+    std::memset(reinterpret_cast<void *>(header::node_data_start(result)), 0,
+                std::size_t(header::node_data_size(result)));
+#endif
+    pagemap::insert(result);
+    pools.total_alloc.fetch_add(std::size_t(result->node_size));
   }
-
-  constexpr sp::node_size lookup[] = //
-      {
-          //
-          /*___8:*/ min_alloc,
-          /*__16:*/ min_alloc * 2,
-          /*__32:*/ max_alloc,
-          /*__64:*/ max_alloc,
-          /*_128:*/ max_alloc,
-          /*_256:*/ max_alloc,
-          /*_512:*/ max_alloc,
-          /*1024:*/ max_alloc,
-          /*2048:*/ max_alloc,
-          /*4096:*/ max_alloc,
-          /*8192:*/ min_alloc * 5,
-          //
-      };
-  return lookup[shared::pool_index(bucketSz)];
-}
+  return result;
+} // ::reuse_extent()
 
 static header::Node *
 alloc_extent(global::State &global, local::PoolsRAII &pools,
-             sp::bucket_size bucketSz) noexcept {
-  // printf("alloc_extent(%zu)\n", bucketSz);
-  sp::node_size nodeSz = calc_min_node(bucketSz);
-  void *const raw = alloc(global, pools, nodeSz);
+             const shared::SizeClass &sizeClass) noexcept {
+  // printf("alloc_extent(%zu)\n", sizeClass.bucket_size);
+  const sp::node_size nodeSz(sizeClass.node_size);
+  const sp::bucket_size bucketSz(sizeClass.bucket_size);
+  header::Node *const cached =
+      reuse_extent(pools, pools[shared::pool_index(bucketSz)]);
+  if (cached) {
+    return cached;
+  }
+
+  // extents are naturally aligned so that the Node header can be found by
+  // masking a pointer into the extent
+  const std::size_t alignment = header::extent_alignment(nodeSz);
+  void *const raw = alloc(global, pools, nodeSz, alignment);
   if (raw) {
-    return header::init_extent(raw, nodeSz, bucketSz);
+    return header::init_extent(raw, nodeSz, bucketSz, &pools);
   }
   return nullptr;
 } // ::alloc_extent()
@@ -156,9 +130,13 @@ should_expand_extent(header::Node *) {
 static header::Node *
 enqueue_new_extent(global::State &global, local::PoolsRAII &pools,
                    std::atomic<header::Node *> &w,
-                   sp::bucket_size bucketSz) noexcept {
-  header::Node *const current = ::alloc_extent(global, pools, bucketSz);
+                   const shared::SizeClass &sizeClass) noexcept {
+  header::Node *const current = ::alloc_extent(global, pools, sizeClass);
   if (current) {
+    // extend the bounds before the extent is reachable by other threads
+    local::range_extend(pools[current->size_class].range, current);
+    local::range_extend(pools.range, current);
+
     // TODO some kind of fence to ensure construction before publication
     // std::atomic_thread_fence(std::memory_order_release);
     header::Node *start = nullptr;
@@ -178,50 +156,68 @@ expand_extent(void *const) noexcept {
 } // ::extend_extent()
 
 //=======SHARED===============================================
+static void *
+reserve_next(global::State &global, local::PoolsRAII &pools,
+             const shared::SizeClass &sizeClass, header::Node *&start,
+             bool grow) noexcept {
+reserve_start:
+  void *result = ::reserve(start);
+  if (result) {
+
+    return result;
+  } else {
+    header::Node *const next = ::next_extent(start);
+    if (next) {
+
+      start = next;
+      goto reserve_start;
+    } else if (grow) {
+
+      if (::should_expand_extent(start)) {
+        ::expand_extent(start);
+        goto reserve_start;
+      }
+
+      header::Node *const current =
+          ::enqueue_new_extent(global, pools, start->next, sizeClass);
+      if (current) {
+        start = current;
+        goto reserve_start;
+      }
+    }
+  }
+
+  return nullptr;
+} // ::reserve_next()
+
 namespace shared {
 void *
 alloc(global::State &global, local::PoolsRAII &pools,
       std::size_t length) noexcept {
   assert(pools.reclaim.load() == false);
-  const auto bucketSz = shared::bucket_size_for(length);
-  local::Pool &pool = shared::pool_for(pools, bucketSz);
+  if (pools.remote_free.load(std::memory_order_relaxed)) {
+    shared::drain_remote_free(global, pools, false);
+  }
+
+  const std::size_t index = shared::size_class_index(length);
+  if (index == local::PoolsRAII::BUCKETS) {
+    // larger than the largest size class
+    return nullptr;
+  }
+  const shared::SizeClass &sizeClass = shared::size_class(index);
+  local::Pool &pool = pools[index];
 
   sp::SharedLock guard{pool.lock};
   if (guard) {
 
     header::Node *start = &pool.start;
     if (start) {
-
-    reserve_start:
-      void *result = ::reserve(start);
-      if (result) {
-
-        return result;
-      } else {
-        header::Node *const next = ::next_extent(start);
-        if (next) {
-
-          start = next;
-          goto reserve_start;
-        } else {
-
-          if (::should_expand_extent(start)) {
-            ::expand_extent(start);
-          } else {
-            start = ::enqueue_new_extent(global, pools, start->next, bucketSz);
-          }
-          if (start) {
-            goto reserve_start;
-          }
-
-          // out of memory
-          return nullptr;
-        }
-      }
+      // out of memory when nullptr
+      return ::reserve_next(global, pools, sizeClass, start, true);
     } else {
       // only TL allowed to malloc meaning no alloc contention
       header::Node *current =
-          ::enqueue_new_extent(global, pools, pool.start.next, bucketSz);
+          ::enqueue_new_extent(global, pools, pool.start.next, sizeClass);
       if (current) {
         void *const result = ::reserve(current);
         // Since only one allocator this must succeed.
@@ -246,6 +242,35 @@ alloc(global::State &state, local::Pools &pools, std::size_t length) noexcept {
   return alloc(state, *pools.pools, length);
 } // shared::alloc()
 
+std::size_t
+alloc_batch(global::State &global, local::PoolsRAII &pools, std::size_t index,
+            void **const out, std::size_t length) noexcept {
+  assert(pools.reclaim.load() == false);
+  assert(index < local::PoolsRAII::BUCKETS);
+  if (pools.remote_free.load(std::memory_order_relaxed)) {
+    shared::drain_remote_free(global, pools, false);
+  }
+  const shared::SizeClass &sizeClass = shared::size_class(index);
+  local::Pool &pool = pools[index];
+
+  std::size_t result(0);
+  sp::SharedLock guard{pool.lock};
+  if (guard) {
+    header::Node *start = &pool.start;
+    while (result < length) {
+      // only allocate a new extent if there is nothing to return
+      void *const bucket =
+          ::reserve_next(global, pools, sizeClass, start, result == 0);
+      if (!bucket) {
+        break;
+      }
+      out[result++] = bucket;
+    }
+  }
+
+  return result;
+} // shared::alloc_batch()
+
 } // namespace shared
 
 //=======DEBUG===============================================
@@ -254,8 +279,8 @@ namespace debug {
 std::size_t
 alloc_count_alloc(local::PoolsRAII &p) {
   std::size_t result(0);
-  for (std::size_t i(8); i > 0; i <<= 1) {
-    result += alloc_count_alloc(p, i);
+  for (std::size_t i(0); i < local::PoolsRAII::BUCKETS; ++i) {
+    result += alloc_count_alloc(p, std::size_t(shared::pool_bucket_size(i)));
   }
   return result;
 } // debug::alloc_count_alloc()
@@ -293,6 +318,15 @@ alloc_count_alloc(local::PoolsRAII &p, std::size_t sz) {
       goto start;
     }
   }
+
+  // buckets cached in the magazine are reserved but not allocated, buckets in
+  // the remote free stack are counted as allocated until drained
+  const std::size_t index = shared::pool_index(bsz);
+  if (index < SP_MALLOC_MAGAZINE_CLASSES) {
+    const std::size_t cached = p.magazines[index].length;
+    assert(result >= cached);
+    result -= cached;
+  }
   return result;
 } // debug::alloc_count_alloc()
 
@@ -303,7 +337,7 @@ local_free_get_free(local::PoolsRAII &pool) {
   header::LocalFree &free_list = pool.free_list;
   header::LocalFree *current = free_list.next;
 start:
-  if (current) {
+  if (current != &free_list) {
     result.emplace_back(current, std::size_t(current->size));
     current = current->next;
     goto start;
@@ -10,6 +10,16 @@ alloc(global::State &, local::PoolsRAII &, std::size_t) noexcept;
 void *
 alloc(global::State &, local::Pools &, std::size_t) noexcept;
 
+/* Reserve up to @length buckets of the size class @index into @out under a
+ * single Pool lock. A new extent is only allocated if no bucket is available
+ * in the existing extents.
+ *
+ * @return            The number of buckets reserved
+ */
+std::size_t
+alloc_batch(global::State &, local::PoolsRAII &, std::size_t index,
+            void **out, std::size_t length) noexcept;
+
 } // namespace shared
 
 #endif
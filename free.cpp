@@ -2,6 +2,7 @@
 #include "alloc.h"
 #include "free.h"
 #include "global.h"
+#include "pagemap.h"
 #include "util.h"
 #include <cassert>
 #include <cstring>
@@ -27,6 +28,10 @@ template <typename Res, typename Arg>
 static sp::maybe<Res>
 node_for(local::Pool &pool, void *search, NodeFor<Res, Arg> f,
          Arg &a) noexcept {
+  if (!local::in_range(pool.range, search)) {
+    return {};
+  }
+
   sp::SharedLock guard(pool.lock);
   if (guard) {
     header::Node *current = &pool.start;
@@ -42,6 +47,34 @@ node_for(local::Pool &pool, void *search, NodeFor<Res, Arg> f,
   return {};
 } // ::node_for()
 
+template <typename Res, typename Arg>
+using OwnedFor = Res (*)(local::Pool &, sp::SharedLock &, header::Node *,
+                         void *, Arg &);
+
+template <typename Res, typename Arg>
+static sp::maybe<Res>
+owned_for(local::PoolsRAII &pools, void *const search, OwnedFor<Res, Arg> f,
+          Arg &arg) noexcept {
+  auto entry = pagemap::lookup(search);
+  if (entry && entry.get().owner == &pools) {
+    header::Node *const node = entry.get().node;
+    local::Pool &pool = pools[node->size_class];
+
+    sp::SharedLock guard(pool.lock);
+    if (guard) {
+      // An extent is only removed from the page map during an exclusive Pool
+      // lock, re-validate that the extent was not recycled before we got here.
+      auto current = pagemap::lookup(search);
+      if (current && current.get().node == node &&
+          current.get().owner == &pools &&
+          &pools[node->size_class] == &pool) {
+        return sp::maybe<Res>(f(pool, guard, node, search, arg));
+      }
+    }
+  }
+  return {};
+} // ::owned_for()
+
 static sp::maybe<std::size_t>
 node_index_of(header::Node *const node, void *const ptr) noexcept {
   const sp::node_size data_size = header::node_data_size(node);
@@ -50,17 +83,9 @@ node_index_of(header::Node *const node, void *const ptr) noexcept {
   const std::uintptr_t search = reinterpret_cast<uintptr_t>(ptr);
 
   if (search >= data_start && search < data_end) {
-    std::uintptr_t it = data_start;
-    std::size_t index = 0;
-
-    // TODO make better
-    while (it < data_end) {
-      if (it == search) {
-        // TODO assert index < int32_t::max
-        return sp::maybe<std::size_t>(index);
-      }
-      ++index;
-      it += std::size_t(node->bucket_size);
+    auto index = header::bucket_index(node, search - data_start);
+    if (index) {
+      return sp::maybe<std::size_t>(std::size_t(index.get()));
     }
     assert(false);
   }
@@ -85,6 +110,10 @@ template <typename Res, typename Arg>
 static sp::maybe<Res>
 extent_for(local::Pool &pool, void *const search, ExtFor<Res, Arg> f,
            Arg &arg) noexcept {
+  if (!local::in_range(pool.range, search)) {
+    return {};
+  }
+
   sp::SharedLock guard(pool.lock);
   if (guard) {
     header::Node *current = &pool.start;
@@ -160,9 +189,37 @@ start:
   parent->next.store(current);
 } //::unlink_extent()
 
+// Keep the empty extent @head in its size class so that an alloc/free
+// oscillation around an extent boundary does not recycle it over and over.
+static bool
+cache_extent(shared::State &state, header::Node *const head) noexcept {
+  if (&state.pool != &state.local_pool || state.pool.reclaim.load()) {
+    // only the owning thread touches the cache
+    return false;
+  }
+  if (head->next.load() != nullptr) {
+    return false;
+  }
+
+  local::Pool &pool = state.pool[head->size_class];
+  const std::size_t length(head->node_size);
+  if (pool.empty_length >= SP_MALLOC_EMPTY_EXTENTS ||
+      (pool.empty_length + 1) * length > SP_MALLOC_EMPTY_EXTENT_BYTES) {
+    return false;
+  }
+
+  head->next.store(pool.empty);
+  pool.empty = head;
+  ++pool.empty_length;
+  return true;
+} //::cache_extent()
+
 static std::size_t
 recycle_extent(shared::State &state, header::Node *head) noexcept {
   assert(head);
+  if (cache_extent(state, head)) {
+    return std::size_t(head->node_size);
+  }
 
   std::size_t recycled(0);
   header::LocalFree *first = nullptr;
@@ -189,12 +246,73 @@ start:
     }
   } else {
     local::dealloc(state.pool, first, last);
+    if (&state.pool == &state.local_pool) {
+      // only the owning thread can return its free list to global
+      local::trim(state.global, state.pool);
+    }
   }
   return recycled;
 } //::recycle_extent()
 
 static FreeCode
-free_logic(local::Pool &pool, void *search, header::Node *&recycled) noexcept {
+free_index(local::Pool &pool, sp::SharedLock &shared_guard,
+           header::Node *parent, header::Node *const head, sp::index index,
+           header::Node *&recycled) noexcept {
+  header::Extent *const extent = header::extent(head);
+  if (perform_free(extent, index)) {
+    if (header::is_empty(extent)) {
+
+      sp::TryPrepareLock pre_guard(shared_guard);
+      if (pre_guard) {
+        sp::EagerExclusiveLock ex_guard(pre_guard);
+        if (ex_guard) {
+          if (header::is_empty(extent)) {
+            // we need to consider that malloc can insert new extent and
+            // nodes concurrently when this is performed. This means that
+            // parent read during the shared lock can be different now
+            // during the exclusive lock. Solve this by iterating from
+            // parent until head is next, this work since during an
+            // exclusive lock there can not be any new extents or nodes.
+
+            parent = find_parent(parent, head);
+            unlink_extent(parent, head);
+            // removed during the exclusive lock so a concurrent lookup
+            // holding the shared lock never observe a recycled extent
+            pagemap::remove(head);
+            local::range_reset(pool.range, &pool.start);
+            recycled = head;
+
+            return FreeCode::FREED_RECLAIM;
+          } /*is_empty*/
+        } /*exclusive*/ else {
+          // should always succeed
+          assert(false);
+        }
+      } /*prepare*/ else {
+        assert(false);
+        // TODO what now?
+        // - retry
+        // - store in NodeHead that the node should be reclaimed
+        //  - set extent_reclaim true on the head node
+        //  - malloc thread sees extent_reclaim and ignores the extent
+        //  - freeing thread sees extent_reclaim and checks
+        //    is_empty(extent) if not true unset flag, if true free to
+        //    reclaim
+      }
+    } /*is_empty*/
+
+    return FreeCode::FREED;
+  } /*perform_free*/
+
+  return FreeCode::DOUBLE_FREE;
+} //::free_index()
+
+static FreeCode
+free_scan(local::Pool &pool, void *search, header::Node *&recycled) noexcept {
+  if (!local::in_range(pool.range, search)) {
+    return FreeCode::NOT_FOUND;
+  }
+
   sp::SharedLock shared_guard(pool.lock);
   if (shared_guard) {
     header::Node *parent = &pool.start;
@@ -213,49 +331,7 @@ free_logic(local::Pool &pool, void *search, header::Node *&recycled) noexcept {
         assert(head);
         index = index + nodeIdx.get();
 
-        header::Extent *const extent = header::extent(head);
-        if (perform_free(extent, index)) {
-          if (header::is_empty(extent)) {
-
-            sp::TryPrepareLock pre_guard(shared_guard);
-            if (pre_guard) {
-              sp::EagerExclusiveLock ex_guard(pre_guard);
-              if (ex_guard) {
-                if (header::is_empty(extent)) {
-                  // we need to consider that malloc can insert new extent and
-                  // nodes concurrently when this is performed. This means that
-                  // parent read during the shared lock can be different now
-                  // during the exclusive lock. Solve this by iterating from
-                  // parent until head is next, this work since during an
-                  // exclusive lock there can not be any new extents or nodes.
-
-                  parent = find_parent(parent, head);
-                  unlink_extent(parent, head);
-                  recycled = head;
-
-                  return FreeCode::FREED_RECLAIM;
-                } /*is_empty*/
-              } /*exclusive*/ else {
-                // should always succeed
-                assert(false);
-              }
-            } /*prepare*/ else {
-              assert(false);
-              // TODO what now?
-              // - retry
-              // - store in NodeHead that the node should be reclaimed
-              //  - set extent_reclaim true on the head node
-              //  - malloc thread sees extent_reclaim and ignores the extent
-              //  - freeing thread sees extent_reclaim and checks
-              //    is_empty(extent) if not true unset flag, if true free to
-              //    reclaim
-            }
-          } /*is_empty*/
-
-          return FreeCode::FREED;
-        } /*perform_free*/
-
-        return FreeCode::DOUBLE_FREE;
+        return free_index(pool, shared_guard, parent, head, index, recycled);
       } // nodeIdx
       index = index + node_buckets(current);
 
@@ -264,6 +340,49 @@ free_logic(local::Pool &pool, void *search, header::Node *&recycled) noexcept {
     } // current
   }   /*shared*/
 
+  return FreeCode::NOT_FOUND;
+} //::free_scan()
+
+static FreeCode
+free_node(local::Pool &pool, sp::SharedLock &shared_guard,
+          header::Node *const head, void *const search,
+          header::Node *&recycled) noexcept {
+  auto nodeIdx = node_index_of(head, search);
+  if (nodeIdx) {
+    const sp::index index(nodeIdx.get());
+    return free_index(pool, shared_guard, &pool.start, head, index,
+                      recycled);
+  }
+
+  return FreeCode::NOT_FOUND;
+} //::free_node()
+
+static FreeCode
+free_logic(local::PoolsRAII &pools, void *const search,
+           header::Node *&recycled) noexcept {
+  auto result = owned_for<FreeCode, header::Node *>(pools, search, free_node,
+                                                    recycled);
+  if (result) {
+    return result.get();
+  }
+
+  if (!pagemap::is_complete()) {
+    // Fallback to the linear search since the page map does not contain all
+    // extents
+    auto logic = [](local::Pool &p, void *s,
+                    header::Node *&r) -> sp::maybe<FreeCode> {
+      auto res = free_scan(p, s, r);
+      if (res == FreeCode::NOT_FOUND) {
+        return {};
+      }
+
+      return sp::maybe<FreeCode>(res);
+    };
+    auto res = local::pools_find<FreeCode, header::Node *>(pools, search,
+                                                           logic, recycled);
+    return res.get_or(FreeCode::NOT_FOUND);
+  }
+
   return FreeCode::NOT_FOUND;
 } //::free_logic()
 
@@ -288,11 +407,9 @@ free_reclaim(shared::State &state, FreeCode c, header::Node *rExts) noexcept {
 } //::free_reclaim()
 
 static FreeCode
-free(shared::State &state, void *ptr, sp::bucket_size length) noexcept {
-  local::Pool &pool = shared::pool_for(state.pool, length);
-
+free(shared::State &state, void *const ptr) noexcept {
   header::Node *recycled_ext = nullptr;
-  auto result = free_logic(pool, ptr, recycled_ext);
+  auto result = free_logic(state.pool, ptr, recycled_ext);
   if (result == FreeCode::NOT_FOUND || result == FreeCode::DOUBLE_FREE) {
     return result;
   }
@@ -301,38 +418,121 @@ free(shared::State &state, void *ptr, sp::bucket_size length) noexcept {
 } //::free()
 
 namespace shared {
+// marks the remote free stack of an exited owner
+static header::RemoteFree *const REMOTE_FREE_CLOSED =
+    reinterpret_cast<header::RemoteFree *>(std::uintptr_t(1));
 
 FreeCode
 free(shared::State &state, void *const ptr) noexcept {
   assert(ptr);
-  header::Node *recycledExtent = nullptr;
+  return ::free(state, ptr);
+} // shared::free()
 
-  auto logic = [](local::Pool &p, void *search,
-                  header::Node *&recycled) -> sp::maybe<FreeCode> {
-    auto result = free_logic(p, search, recycled);
-    if (result == FreeCode::NOT_FOUND) {
-      return {};
-    }
+FreeCode
+remote_free(local::PoolsRAII &owner, header::Node *const node,
+            void *const ptr) noexcept {
+  assert(node);
+  assert(ptr);
+  const std::uintptr_t data_start = header::node_data_start(node);
+  const std::uintptr_t search = reinterpret_cast<std::uintptr_t>(ptr);
+  if (search < data_start) {
+    return FreeCode::NOT_FOUND;
+  }
+  auto index = header::bucket_index(node, search - data_start);
+  if (!index || !(index.get() < node->buckets)) {
+    return FreeCode::NOT_FOUND;
+  }
 
-    return sp::maybe<FreeCode>(result);
-  };
-  auto res = local::pools_find<FreeCode, header::Node *>(state.pool, ptr, logic,
-                                                         recycledExtent);
+  // The bucket stays reserved until the owner drains the stack
+  header::Extent *const extent = header::extent(node);
+  if (!extent->reserved.test(std::size_t(index.get()))) {
+    return FreeCode::DOUBLE_FREE;
+  }
 
-  FreeCode result = res.get_or(FreeCode::NOT_FOUND);
-  if (result == FreeCode::NOT_FOUND || result == FreeCode::DOUBLE_FREE) {
-    return result;
+  header::RemoteFree *const entry = new (ptr) header::RemoteFree;
+  header::RemoteFree *head = owner.remote_free.load(std::memory_order_relaxed);
+retry:
+  if (head == REMOTE_FREE_CLOSED) {
+    // the owner has exited, the caller should free @ptr directly
+    return FreeCode::NOT_FOUND;
+  }
+  entry->next = head;
+  if (!owner.remote_free.compare_exchange_weak(head, entry,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+    goto retry;
   }
 
-  return free_reclaim(state, result, recycledExtent);
-} // shared::free()
+  return FreeCode::FREED;
+} // shared::remote_free()
+
+void
+drain_remote_free(global::State &global, local::PoolsRAII &pools,
+                  bool close) noexcept {
+  header::RemoteFree *head = pools.remote_free.exchange(
+      close ? REMOTE_FREE_CLOSED : nullptr, std::memory_order_acquire);
+
+  shared::State state(global, pools, pools);
+start:
+  if (head && head != REMOTE_FREE_CLOSED) {
+    header::RemoteFree *const next = head->next;
+    const FreeCode code = ::free(state, head);
+    if (code == FreeCode::DOUBLE_FREE) {
+      // the same bucket was pushed twice, the stack now contains a cycle
+      assert(false);
+      return;
+    }
+    assert(code == FreeCode::FREED);
+
+    head = next;
+    goto start;
+  }
+} // shared::drain_remote_free()
+
+void
+flush_empty_extents(local::PoolsRAII &pools) noexcept {
+  for (auto &pool : pools.buckets) {
+    header::LocalFree *first = nullptr;
+    header::LocalFree *last = nullptr;
+    header::Node *head = pool.empty;
+  next:
+    if (head) {
+      header::Node *const next = head->next.load();
+      first = header::init_local_free(head, head->node_size, first);
+      if (!last) {
+        last = first;
+      }
+      head = next;
+      goto next;
+    }
+
+    if (first) {
+      local::dealloc(pools, first, last);
+    }
+    pool.empty = nullptr;
+    pool.empty_length = 0;
+  }
+} // shared::flush_empty_extents()
 
 sp::maybe<sp::bucket_size>
 usable_size(local::PoolsRAII &pools, void *const ptr) noexcept {
   using Arg = std::nullptr_t;
   Arg arg = nullptr;
 
-  auto res = local::pools_find<sp::bucket_size, Arg>(
+  auto res = owned_for<sp::bucket_size, Arg>(
+      pools, ptr, //
+      [](local::Pool &, sp::SharedLock &, header::Node *node, void *,
+         Arg &) -> sp::bucket_size { //
+        return node->bucket_size;
+      },
+      arg);
+  if (res || pagemap::is_complete()) {
+    return res;
+  }
+
+  // Fallback to the linear search since the page map does not contain all
+  // extents
+  return local::pools_find<sp::bucket_size, Arg>(
       pools, ptr, //
       [](local::Pool &pool, void *search,
          Arg &a) -> sp::maybe<sp::bucket_size> { //
@@ -344,7 +544,6 @@ usable_size(local::PoolsRAII &pools, void *const ptr) noexcept {
             a);
       },
       arg);
-  return res;
 } // shared::usable_size()
 
 sp::maybe<sp::bucket_size>
@@ -353,6 +552,16 @@ usable_size(local::Pools &pools, void *const ptr) noexcept {
   return usable_size(*pools.pools, ptr);
 } // shared::usable_size()
 
+static bool
+should_shrink(sp::bucket_size memSz, std::size_t length) noexcept {
+  const std::size_t index = size_class_index(length);
+  if (index == local::PoolsRAII::BUCKETS) {
+    return false;
+  }
+  const std::size_t smaller(pool_bucket_size(index));
+  return std::size_t(memSz) >= smaller * SP_MALLOC_SHRINK_FACTOR;
+} // shared::should_shrink()
+
 sp::maybe<void *>
 realloc(shared::State &state, void *ptr, std::size_t length,
         /*OUT*/ FreeCode &code) noexcept {
@@ -367,10 +576,20 @@ realloc(shared::State &state, void *ptr, std::size_t length,
         // runtime fault, out of memory
         assert(false);
       }
-      code = ::free(state, ptr, memSz);
+      code = ::free(state, ptr);
       assert(code == FreeCode::FREED || code == FreeCode::FREED_RECLAIM);
 
       ptr = nptr;
+    } else if (should_shrink(memSz, length)) {
+      void *const nptr = alloc(state.global, state.local_pool, length);
+      // keeping the larger bucket is fine when out of memory
+      if (nptr) {
+        std::memcpy(nptr, ptr, length);
+        code = ::free(state, ptr);
+        assert(code == FreeCode::FREED || code == FreeCode::FREED_RECLAIM);
+
+        ptr = nptr;
+      }
     }
     return sp::maybe<void *>(ptr);
   }
@@ -16,6 +16,32 @@ namespace shared {
 FreeCode
 free(shared::State &, void *) noexcept;
 
+/* Push @ptr onto the remote free stack of @owner with a single CAS, to be
+ * freed by the owning thread in drain_remote_free().
+ *
+ * @param[in] owner   The pools owning the extent
+ * @param[in] node    The extent containing @ptr
+ * @param[in] ptr     The memory to free
+ * @return            FREED when pushed, DOUBLE_FREE if @ptr is not reserved or
+ *                    NOT_FOUND if @ptr must be freed directly
+ */
+FreeCode
+remote_free(local::PoolsRAII &owner, header::Node *node, void *ptr) noexcept;
+
+/* Free all buckets pushed by other threads onto the remote free stack of
+ * @pools, only called by the owning thread. When @close is true the stack is
+ * closed and later remote frees fallback to freeing directly.
+ */
+void
+drain_remote_free(global::State &, local::PoolsRAII &pools,
+                  bool close) noexcept;
+
+/* Return the empty extents cached in the size classes of @pools to its free
+ * list, only called by the owning thread.
+ */
+void
+flush_empty_extents(local::PoolsRAII &pools) noexcept;
+
 /* Tries to lookup the size of the underlying bucket referenced by @ptr. Will
  * return the size of the underlying bucket if @ptr is owned by @pool or None.
  *
@@ -1,6 +1,6 @@
 #include "global.h"
 
-#include <concurrent/ReadWriteLock.h>
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <mutex>
@@ -9,371 +9,418 @@
 #include "global_debug.h"
 #endif
 
-#include <unistd.h> //sbrk
+#include "numa.h"
+#include "tree.h"
+#include <sys/mman.h> //mmap
+
+// Free spans are indexed by two AVL trees, by page number to find the
+// neighbours to coalesce with and by [purged, pages, address] for a best fit
+// which prefers dirty spans.
+struct ByAddress {
+  static header::Free *&
+  left(header::Free *f) noexcept {
+    return f->address_left;
+  }
+  static header::Free *&
+  right(header::Free *f) noexcept {
+    return f->address_right;
+  }
+  static std::uint8_t &
+  height(header::Free *f) noexcept {
+    return f->address_height;
+  }
+  static bool
+  less(const header::Free *a, const header::Free *b) noexcept {
+    return a < b;
+  }
+};
 
-static void
-free_dequeue(header::Free *head, header::Free *target) noexcept {
-  assert(head != target);
-  head->next.store(target->next.load());
-  target->next.store(nullptr);
-} // ::free_dequeue()
+struct BySize {
+  static header::Free *&
+  left(header::Free *f) noexcept {
+    return f->size_left;
+  }
+  static header::Free *&
+  right(header::Free *f) noexcept {
+    return f->size_right;
+  }
+  static std::uint8_t &
+  height(header::Free *f) noexcept {
+    return f->size_height;
+  }
+  static bool
+  less(const header::Free *a, const header::Free *b) noexcept {
+    if (a->purged != b->purged) {
+      return !a->purged;
+    }
+    if (a->pages != b->pages) {
+      return a->pages < b->pages;
+    }
+    return a < b;
+  }
+};
 
 static void
-free_enqueue(header::Free *head, header::Free *target) noexcept {
-  assert(head);
-  assert(target);
-  assert(head != target);
-
-  if (header::is_consecutive(head, target)) {
-    header::Free *const next = head->next.load(std::memory_order_relaxed);
-    header::coalesce(head, target, next);
-  } else {
-    target->next.store(head->next.load());
-    head->next.store(target);
+free_remove(global::State &state, header::Free *const free) noexcept {
+  state.free_address =
+      tree::remove<header::Free, ByAddress>(state.free_address, free);
+  state.free_size = tree::remove<header::Free, BySize>(state.free_size, free);
+} // ::free_remove()
+
+// The smallest span of at least @pages with the @purged state
+static header::Free *
+best_fit(global::State &state, sp::pages pages, bool purged) noexcept {
+  header::Free *const result = tree::lower_bound<header::Free, BySize>(
+      state.free_size, [pages, purged](const header::Free *f) {
+        if (f->purged != purged) {
+          return !f->purged;
+        }
+        return f->pages < pages;
+      });
+  if (result && result->purged == purged) {
+    return result;
+  }
+  return nullptr;
+} // ::best_fit()
+
+// Requires the free_lock of @state to be held
+static header::Free *
+find_free_locked(global::State &state, sp::pages pages) noexcept {
+  // prefer dirty spans, reusing a purged span costs a page fault per page
+  header::Free *current = best_fit(state, pages, false);
+  if (!current) {
+    current = best_fit(state, pages, true);
   }
-} // ::free_enqueue()
 
-header::Free *
-find_free(global::State &state, sp::node_size size) noexcept {
-start:
-  if (true) {
-    header::Free *head = &state.free;
-    sp::TrySharedLock cur_shared_guard(head->next_lock);
-    if (!cur_shared_guard) {
-      //...
-      goto start;
+  if (current) {
+    if (pages == current->pages) {
+      free_remove(state, current);
+      return current;
     }
-  retry:
-    if (true) {
-      // [Current:SHARED][Next:-]
-
-      header::Free *const current = head->next;
-      if (current) {
-
-        sp::TrySharedLock next_shared_guard(current->next_lock);
-        if (next_shared_guard) {
-          if (size <= current->size) {
-            // matching
-
-            sp::TryPrepareLock cur_pre_guard(cur_shared_guard);
-            if (cur_pre_guard) {
-              // [Current:PREPARE][Next:-]
-
-              sp::TryPrepareLock next_pre_guard(next_shared_guard);
-              if (next_pre_guard) {
-
-                sp::EagerExclusiveLock cur_exc_guard(cur_pre_guard);
-                sp::EagerExclusiveLock next_exc_guard(next_pre_guard);
-                if (cur_exc_guard && next_exc_guard) {
-                  {
-                    assert(head->next_lock.has_exclusive_lock());
-                    assert(head->next_lock.shared_locks() == 0);
-                    assert(!head->next_lock.has_prepare_lock());
-
-                    assert(current->next_lock.has_exclusive_lock());
-                    assert(current->next_lock.shared_locks() == 0);
-                    assert(!current->next_lock.has_prepare_lock());
-                  }
-
-                  if (size == current->size ||
-                      (size + sizeof(header::Free)) > current->size) {
-                    // printf("free_dequeue(head,
-                    // current)size:%zu,cur-sz:%zu\n",
-                    //        size, current->size);
-                    free_dequeue(head, current);
-                    return current;
-                  } else {
-                    // printf("header::reduce(current,
-                    // size)size:%zu,cur-sz:%zu\n",
-                    //        size, current->size);
-                    return header::reduce(current, size);
-                  }
-                } /*cur_exc_guard*/ else {
-                  // bug
-                  assert(false);
-                  return nullptr;
-                }
-              } /*next_pre_guard*/ else {
-                // Could not lock current->next
-                cur_shared_guard.swap(next_shared_guard);
-                head = current;
-                goto retry;
-              }
-            } /*cur_pre_guard*/ else {
-              // Some other thread got here first, continue
-              cur_shared_guard.swap(next_shared_guard);
-              head = current;
-              goto retry;
-            }
-          } else {
-            // Not matching, continue
-            cur_shared_guard.swap(next_shared_guard);
-            head = current;
-            goto retry;
-          }
-        } /*next_shared_guard*/ else {
-          goto start; //???
-        }
-      } else {
-        // Not found any matching Free node
-        return nullptr;
+
+    // the span is reduced from the end so only its size changes
+    state.free_size =
+        tree::remove<header::Free, BySize>(state.free_size, current);
+    header::Free *const result = header::reduce(current, pages);
+    state.free_size =
+        tree::insert<header::Free, BySize>(state.free_size, current);
+    return result;
+  }
+
+  return nullptr;
+} // ::find_free_locked()
+
+static header::Free *
+find_free(global::State &state, sp::pages pages) noexcept {
+  std::lock_guard<std::mutex> guard(state.free_lock);
+  return find_free_locked(state, pages);
+} // ::find_free()
+
+// The first span of exactly @pages with the @purged state which starts at a
+// multiple of @align pages. The spans of the same size are adjacent in the
+// size tree so only those are visited.
+static header::Free *
+aligned_fit(global::State &state, sp::pages pages, std::size_t align,
+            bool purged) noexcept {
+  header::Free *current = best_fit(state, pages, purged);
+next:
+  if (current && current->purged == purged && current->pages == pages) {
+    if ((header::page_number(current) & (align - 1)) == 0) {
+      return current;
+    }
+    current = tree::lower_bound<header::Free, BySize>(
+        state.free_size, [current](const header::Free *f) { //
+          return !BySize::less(current, f);
+        });
+    goto next;
+  }
+
+  return nullptr;
+} // ::aligned_fit()
+
+static header::Free *
+find_aligned(global::State &state, sp::pages pages,
+             std::size_t align) noexcept {
+  std::lock_guard<std::mutex> guard(state.free_lock);
+  header::Free *result = aligned_fit(state, pages, align, false);
+  if (!result) {
+    result = aligned_fit(state, pages, align, true);
+  }
+  if (result) {
+    free_remove(state, result);
+  }
+  return result;
+} // ::find_aligned()
+
+// Take a free range from one of the sibling arenas of @state. A sibling which
+// is currently locked is skipped rather than waited on, contending on the
+// free_lock of another arena is what the arenas are there to avoid.
+static header::Free *
+steal_free(global::State &state, sp::pages pages) noexcept {
+  global::State *current = state.sibling;
+next:
+  if (current != &state) {
+    if (current->node != state.node) {
+      // memory of a remote node is not stolen, growing is preferred
+      current = current->sibling;
+      goto next;
+    }
+    std::unique_lock<std::mutex> guard(current->free_lock, std::try_to_lock);
+    if (guard.owns_lock()) {
+      header::Free *const result = find_free_locked(*current, pages);
+      if (result) {
+        return result;
       }
     }
+    current = current->sibling;
+    goto next;
   }
+
   return nullptr;
-} // ::find_free()
+} // ::steal_free()
+
+static bool
+arena_reserve(global::State &state, std::size_t atLeast) noexcept {
+  // only address space is reserved, no memory is committed until
+  // arena_commit()
+  std::size_t length = std::max(atLeast, SP_MALLOC_ARENA_RESERVE);
+retry:
+  void *const res = ::mmap(nullptr, length, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (res != MAP_FAILED) {
+    // the policy is inherited by the pages committed later on
+    numa::bind(res, length, state.node);
+    // the uncommitted tail of a previous reservation is abandoned
+    state.arena_position = reinterpret_cast<std::uintptr_t>(res);
+    state.arena_end = state.arena_position + length;
+
+    const std::size_t index =
+        state.reservations_length.load(std::memory_order_relaxed);
+    if (index < SP_MALLOC_ARENA_RESERVATIONS) {
+      state.reservations[index] = {state.arena_position, state.arena_end};
+      state.reservations_length.store(index + 1, std::memory_order_release);
+    }
+    return true;
+  } else if (length > atLeast) {
+    length = std::max(length / 2, atLeast);
+    goto retry;
+  }
 
-header::Free *
-alloc_free(global::State &state, sp::node_size atLeast) noexcept {
+  return false;
+} // ::arena_reserve()
+
+static header::Free *
+arena_commit(global::State &state, sp::pages pages) noexcept {
+  const std::size_t atLeast = std::size_t(pages) << SP_MALLOC_PAGE_SHIFT;
+  void *result = nullptr;
+  std::size_t allocSz(0);
   {
-    std::lock_guard<std::mutex> guard(state.brk_lock);
+    std::lock_guard<std::mutex> guard(state.arena_lock);
     // TODO some algorithm to determine optimal alloc size
-    sp::node_size allocSz(0);
-    allocSz = std::max(state.brk_alloc, std::size_t(SP_ALLOC_INITIAL_ALLOC));
+    allocSz = std::max(state.arena_alloc, std::size_t(SP_ALLOC_INITIAL_ALLOC));
     allocSz = std::max(atLeast, allocSz);
-  // TODO check size wrap around
+
   retry:
-    void *const res = ::sbrk(std::size_t(allocSz));
-    if (res != (void *)-1) {
-      state.brk_alloc += std::size_t(allocSz);
-      return header::init_free(res, allocSz);
-    } else if (allocSz > atLeast) {
-      allocSz = allocSz / 2;
-      allocSz = std::max(allocSz, atLeast);
-      goto retry;
+    const std::size_t available = state.arena_end - state.arena_position;
+    if (allocSz > available) {
+      if (available >= atLeast && available > 0) {
+        allocSz = available;
+      } else if (!arena_reserve(state, allocSz)) {
+        if (allocSz > atLeast) {
+          allocSz = atLeast;
+          goto retry;
+        }
+        return nullptr;
+      }
     }
+
+    result = reinterpret_cast<void *>(state.arena_position);
+    state.arena_position += allocSz;
+    state.arena_alloc += allocSz;
   }
 
-  return nullptr;
+  // the range is exclusively ours, commit it without holding the lock
+  if (::mprotect(result, allocSz, PROT_READ | PROT_WRITE) != 0) {
+    // the range is leaked as reserved address space
+    return nullptr;
+  }
+  return header::init_free(result, sp::pages(allocSz >> SP_MALLOC_PAGE_SHIFT));
+} // ::arena_commit()
+
+static header::Free *
+alloc_free(global::State &state, sp::pages atLeast) noexcept {
+  return arena_commit(state, atLeast);
 } // ::alloc_free()
 
-void
-return_free(global::State &state, header::Free *const toReturn) noexcept {
-// [Head]->[Current]->[Next]
-start:
-  if (true) {
-    header::Free *head = &state.free;
-    sp::TrySharedLock cur_shared_guard(head->next_lock);
-    if (!cur_shared_guard) {
-      //...
-      goto start;
-    }
-  retry:
-    if (true) {
-      // [Current:SHARED][Next:-]
-
-      sp::TryPrepareLock cur_pre_guard(cur_shared_guard);
-      if (cur_pre_guard) {
-        // [Current:PREPARE][Next:-]
-
-        header::Free *const current = head->next;
-        if (current) { //<--------------------
-          if (toReturn > current) {
-
-            sp::TrySharedLock next_shared_guard(current->next_lock);
-            if (next_shared_guard) {
-              // [Current:PREPARE][Next:SHARED]
-
-              if (toReturn > current->next.load()) {
-                // higher than next aswell
-                cur_shared_guard.swap(next_shared_guard);
-                head = current;
-                goto retry;
-              }
-
-              // TODO should succeed if prepare:0 & // exc:0
-              sp::TryPrepareLock next_pre_guard(next_shared_guard);
-              if (next_pre_guard) {
-                // [Current:PREPARE][Next:EXCLUSIVE]
-
-                // TODO cur_lock shoud unblockingly set the exclusive flag and
-                // continue to let next_lock execute in paralell first when we
-                // check for success. In the if case we should block until
-                // exclusive lock. Applies to both return & alloc free
-                sp::EagerExclusiveLock cur_exc_guard(cur_pre_guard);
-                sp::EagerExclusiveLock next_exc_guard(next_pre_guard);
-                if (cur_exc_guard && next_exc_guard) {
-                  // [Current:EXCLUSIVE][Next:EXCLUSIVE]
-                  {
-                    assert(head->next_lock.has_exclusive_lock());
-                    assert(head->next_lock.shared_locks() == 0);
-                    assert(!head->next_lock.has_prepare_lock());
-
-                    assert(current->next_lock.has_exclusive_lock());
-                    assert(current->next_lock.shared_locks() == 0);
-                    assert(!current->next_lock.has_prepare_lock());
-                  }
-
-                  free_enqueue(current, toReturn);
-
-                  // header::Free *const next = current->next.load();
-                  // if (header::is_consecutive(current, next)) {
-                  // //?
-                  // header::Free *const next_next =
-                  //     next->next.load(std::memory_order_acquire);
-                  // header::coalesce(current, next, next_next);
-                  // }
-                  return;
-                } /*Current Exclusive Guard*/ else {
-                  // bug - TODO if PREPARE then a exclusive should always
-                  // succeed?
-                  assert(false);
-                  return;
-                }
-              } /*Next Exclusive Guard*/ else {
-                //...???
-                goto start;
-              }
-            } /*Next Shared Guard*/ else {
-              //...???
-              goto start;
-            }
-          }
-          /*
-           *
-           */
-          sp::TrySharedLock next_shared_guard(current->next_lock);
-          if (next_shared_guard) {
-            cur_shared_guard.swap(next_shared_guard);
-            head = current;
-            goto retry;
-          } /*next_shared_guard*/ else {
-            //...?
-            goto start;
-          }
-          //<---------------------------
-        } /*current*/ else {
-          // current is null
-          free_enqueue(head, toReturn);
-          return;
-        }
-      } /*current_pre_guard*/ else {
-        // assert(false); // TODO fails
-        goto start;
-      }
+static bool
+is_reserved_by(const global::State &state, std::uintptr_t address) noexcept {
+  const std::size_t length =
+      state.reservations_length.load(std::memory_order_acquire);
+  for (std::size_t i = 0; i < length; ++i) {
+    const global::Reservation &current = state.reservations[i];
+    if (address >= current.start && address < current.end) {
+      return true;
     }
-    assert(false); // leak memory here
   }
+  return false;
+} // ::is_reserved_by()
+
+// The arena in the ring of @state whose reservation contains @ptr. A span is
+// returned to the arena it was committed from so it stays on the NUMA node
+// that arena is bound to and can coalesce with its neighbours. Memory which
+// none of the arenas have reserved is kept by @state.
+static global::State &
+arena_containing(global::State &state, const void *const ptr) noexcept {
+  const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(ptr);
+  global::State *current = &state;
+next:
+  if (is_reserved_by(*current, address)) {
+    return *current;
+  }
+  current = current->sibling;
+  if (current != &state) {
+    goto next;
+  }
+
+  return state;
+} // ::arena_containing()
+
+static void *
+page_address(std::uintptr_t page) noexcept {
+  return reinterpret_cast<void *>(page << SP_MALLOC_PAGE_SHIFT);
+} // ::page_address()
+
+static void
+return_free(global::State &state, header::Free *toReturn) noexcept {
+  std::lock_guard<std::mutex> guard(state.free_lock);
+
+  // [priv][toReturn][next]
+  auto before = [toReturn](const header::Free *f) { return f < toReturn; };
+  header::Free *const priv =
+      tree::last_before<header::Free, ByAddress>(state.free_address, before);
+  header::Free *const next =
+      tree::lower_bound<header::Free, ByAddress>(state.free_address, before);
+
+  if (priv && header::is_consecutive(priv, toReturn)) {
+    // the address of priv is unchanged, only its size
+    state.free_size = tree::remove<header::Free, BySize>(state.free_size, priv);
+    header::coalesce(priv, toReturn);
+    toReturn = priv;
+  } else {
+    state.free_address =
+        tree::insert<header::Free, ByAddress>(state.free_address, toReturn);
+  }
+
+  if (next && header::is_consecutive(toReturn, next)) {
+    free_remove(state, next);
+    header::coalesce(toReturn, next);
+  }
+
+  state.free_size =
+      tree::insert<header::Free, BySize>(state.free_size, toReturn);
 } // ::return_free()
 
-void
-return_free(global::State &s, void *const ptr, sp::node_size length) noexcept {
+static void
+return_free(global::State &s, void *const ptr, sp::pages length,
+            bool purged) noexcept {
   header::Free *const toReturn = header::init_free(ptr, length);
   if (toReturn) {
     assert(ptr == toReturn);
+    toReturn->purged = purged;
     return return_free(s, toReturn);
   }
 } // ::return_free()
 
-//=======DEBUG===============================================
-#ifdef SP_TEST
-namespace debug { //
+// Only the pages after the one holding the Free header are purged
+static bool
+purge_bounds(const header::Free *const free, std::uintptr_t &start,
+             std::uintptr_t &end) noexcept {
+  const std::uintptr_t head = reinterpret_cast<std::uintptr_t>(free);
+  start = head + SP_MALLOC_PAGE_SIZE;
+  end = head + header::free_length(free);
+  return end > start;
+} // ::purge_bounds()
+
 static void
-debug_print_free(header::Free *const head) {
-  if (head) {
-    void *t = reinterpret_cast<void *>(head);
-    printf("[%p,%zu]", t, std::size_t(head->size));
-    debug_print_free(head->next.load());
-  } else {
-    printf("\n");
+purge_range(header::Free *const free) noexcept {
+  std::uintptr_t start(0);
+  std::uintptr_t end(0);
+  if (purge_bounds(free, start, end)) {
+    // MADV_DONTNEED drops the pages immediately, the range reads as zero
+    // filled the next time it is touched
+    ::madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED);
   }
-} // test::debug_print_free()
+  free->purged = true;
+} // ::purge_range()
 
+static void
+maybe_purge(global::State &state) noexcept {
+  const std::uint64_t now = util::monotonic_ms();
+  std::uint64_t at = state.purge_at.load(std::memory_order_relaxed);
+  if (now >= at) {
+    // only one thread purges per decay period
+    if (state.purge_at.compare_exchange_strong(at,
+                                               now + SP_MALLOC_PURGE_DECAY_MS)) {
+      global::purge(state, now);
+    }
+  }
+} // ::maybe_purge()
+
+//=======DEBUG===============================================
+#ifdef SP_TEST
+namespace debug { //
 std::vector<std::tuple<void *, std::size_t>>
 global_get_free(global::State &state) {
+  std::lock_guard<std::mutex> guard(state.free_lock);
   std::vector<std::tuple<void *, std::size_t>> result;
-  header::Free *head = state.free.next.load();
-start:
-  if (head) {
-    result.emplace_back(head, head->size);
-    head = head->next.load(std::memory_order_acquire);
-    // printf("%zu-%p,%zu\n", ++i, reinterpret_cast<void *>(head), head->size);
-    goto start;
-  }
+  auto f = [&result](header::Free *current) {
+    result.emplace_back(current, header::free_length(current));
+    return true;
+  };
+  tree::for_each<header::Free, ByAddress>(state.free_address, f);
 
   return result;
 } // test::watch_free()
 
 void
 global_clear_free(global::State &state) {
-  state.free.next.store(nullptr);
+  std::lock_guard<std::mutex> guard(state.free_lock);
+  state.free_address = nullptr;
+  state.free_size = nullptr;
 } // test::clear_free()
 
 void
 global_print_free(global::State &state) {
-  header::Free *head = state.free.next.load(std::memory_order_acquire);
-  if (head) {
+  auto free = global_get_free(state);
+  if (!free.empty()) {
     printf("cmpar: ");
-    debug_print_free(head);
+    for (auto &current : free) {
+      printf("[%p,%zu]", std::get<0>(current), std::get<1>(current));
+    }
+    printf("\n");
   }
 } // test::print_free()
 
 std::size_t
 global_count_free(global::State &state) {
-  std::size_t result = 0;
-  header::Free *head = state.free.next.load();
-start:
-  if (head) {
-    result++;
-    head = head->next.load(std::memory_order_acquire);
-    goto start;
-  }
-  return result;
+  return global_get_free(state).size();
 } // test::count_free()
 
-static void
-swap(header::Free *p, header::Free *c, header::Free *n) {
-  p->next.store(n);
-  c->next.store(n->next);
-  n->next.store(c);
-} // swap()
-
 void
-global_sort_free(global::State &state) {
-// TODO
-restart:
-  bool swapped = false;
-  header::Free *priv = &state.free;
-  header::Free *current = priv->next.load();
-start:
-  if (current) {
-    header::Free *const next = current->next;
-    if (next) {
-      if (next > current) {
-        swap(priv, current, next);
-        swapped = true;
-        priv = next;
-        // current = current;
-        goto restart;
-      } else {
-        priv = current;
-        current = next;
-      }
-      goto start;
-    } else if (swapped) {
-      goto restart;
-    }
-  } else if (swapped) {
-    goto restart;
-  }
+global_sort_free(global::State &) {
+  // the free spans are always address ordered
 } // test::sort_free()
 
 void
 global_coalesce_free(global::State &state) {
-  // sort_free(state);
-  header::Free *head = state.free.next.load();
-start:
-  if (head) {
-  get_next:
-    header::Free *const next = head->next;
-    if (next) {
-      if (header::is_consecutive(head, next)) {
-        header::coalesce(head, next, next->next);
-        goto get_next;
-      }
-      head = next;
-      goto start;
-    }
+  // return_free() coalesces with both neighbours
+  auto free = global_get_free(state);
+  for (std::size_t i = 1; i < free.size(); ++i) {
+    const std::uintptr_t priv =
+        reinterpret_cast<std::uintptr_t>(std::get<0>(free[i - 1]));
+    assert(priv + std::get<1>(free[i - 1]) !=
+           reinterpret_cast<std::uintptr_t>(std::get<0>(free[i])));
+    (void)priv;
   }
 } // test::coalesce_free()
 
@@ -384,71 +431,167 @@ start:
 namespace global {
 
 header::Free *
-find_free(State &state, sp::node_size length) noexcept {
+find_free(State &state, sp::pages length) noexcept {
   return ::find_free(state, length);
 } // global::find_free()
 
+void
+link(State *const arenas, std::size_t length) noexcept {
+  assert(arenas);
+  assert(length > 0);
+  const std::size_t nodes = std::min(numa::nodes(), length);
+  for (std::size_t i = 0; i < length; ++i) {
+    arenas[i].sibling = &arenas[(i + 1) % length];
+    arenas[i].node = i % nodes;
+  }
+} // global::link()
+
+State &
+arena_of(State *const arenas, std::size_t length, std::size_t node,
+         std::size_t seq) noexcept {
+  assert(arenas);
+  assert(length > 0);
+  const std::size_t nodes = std::min(numa::nodes(), length);
+  node = node % nodes;
+  // the arenas of @node are [node, node + nodes, node + nodes * 2, ...]
+  const std::size_t per_node = ((length - node) + nodes - 1) / nodes;
+  return arenas[node + ((seq % per_node) * nodes)];
+} // global::arena_of()
+
 void *
-alloc(State &state, sp::node_size p_length) noexcept {
+alloc(State &state, sp::pages pages, std::size_t alignment) noexcept {
 #ifdef SP_TEST
   if (state.skip_alloc) {
     return nullptr;
   }
 #endif
-  if (p_length == 0) {
+  if (pages == 0) {
     return nullptr;
   }
+  assert(util::is_power_of_two(alignment));
+  assert(alignment >= SP_MALLOC_PAGE_SIZE);
+
+  const std::size_t align = alignment >> SP_MALLOC_PAGE_SHIFT;
+  if (align > 1) {
+    // an exact fit which is already aligned leaves no remainders to return
+    header::Free *const exact = find_aligned(state, pages, align);
+    if (exact) {
+      return exact;
+    }
+  }
+
+  // a span of [pages + align - 1] always contains an aligned span of [pages]
+  const sp::pages search(std::size_t(pages) + (align - 1));
 
-  header::Free *free = find_free(state, p_length);
+  header::Free *free = find_free(state, search);
+  if (free == nullptr) {
+    free = steal_free(state, search);
+  }
   if (free == nullptr) {
-    free = alloc_free(state, p_length);
+    free = alloc_free(state, search);
     if (free == nullptr) {
       return nullptr;
     }
   }
 
-  void *const unalign_ptr = reinterpret_cast<void *>(free);
-  void *const align_ptr = util::align_pointer(unalign_ptr, 8);
-  ptrdiff_t unalign_length = util::ptr_diff(align_ptr, unalign_ptr);
-  sp::node_size align_length = free->size - unalign_length;
-
-  if (align_length >= p_length) {
-    if (align_ptr != unalign_ptr) {
-      return_free(state, unalign_ptr, sp::node_size(unalign_length));
-      assert(false);
-    }
-
-    void *const retFree = util::ptr_math(align_ptr, +std::size_t(p_length));
-    const sp::node_size retLength(align_length - p_length);
-    return_free(state, retFree, retLength);
-    return align_ptr;
-  }
+  // [head:prefix][result:pages][tail:suffix]
+  const std::uintptr_t head = header::page_number(free);
+  const std::size_t prefix = (align - (head & (align - 1))) & (align - 1);
+  const std::size_t suffix =
+      std::size_t(free->pages) - prefix - std::size_t(pages);
+  // the remainders keep the purged state of the span they are carved from
+  // and go back to its arena, it may have been stolen from a sibling
+  const bool purged = free->purged;
+  State &owner = arena_containing(state, free);
+
+  return_free(owner, page_address(head), sp::pages(prefix), purged);
+  return_free(owner, page_address(head + prefix + std::size_t(pages)),
+              sp::pages(suffix), purged);
+  return page_address(head + prefix);
+} // global::alloc()
 
-  return_free(state, free);
-  assert(false);
-  return nullptr;
+void *
+alloc(State &state, sp::pages pages) noexcept {
+  return alloc(state, pages, SP_MALLOC_PAGE_SIZE);
 } // global::alloc()
 
 void
-dealloc(State &state, void *const start, sp::node_size length) noexcept {
+dealloc(State &state, void *const start, sp::pages pages) noexcept {
   assert(start);
-  return return_free(state, start, length);
+  State &owner = arena_containing(state, start);
+  return_free(owner, start, pages, false);
+  maybe_purge(owner);
 } // global::dealloc()
 
 void
 dealloc(State &state, header::LocalFree *current) noexcept {
-  assert(free);
 // TODO make better
 next:
   if (current) {
     header::LocalFree *next = current->next;
-    dealloc(state, current, current->size);
+    const std::size_t length(current->size);
+    assert(length % SP_MALLOC_PAGE_SIZE == 0);
+    State &owner = arena_containing(state, current);
+    return_free(owner, current, sp::pages(length >> SP_MALLOC_PAGE_SHIFT),
+                false);
+    maybe_purge(owner);
     current = next;
     goto next;
   }
 } // global::dealloc()
 
-// TODO change so it should be number of pages instead of a specific
-// length+alignment
+std::size_t
+purge(State &state, std::uint64_t now) noexcept {
+  // Dequeue the idle ranges in batches so that madvise() is done without
+  // holding the free list lock, they are returned when the batch is purged.
+  // Each batch resumes after the last range visited by the previous one, a
+  // dirty range which coalesces with a purged one behind it is left for the
+  // next purge.
+  constexpr std::size_t BATCH = 64;
+  std::size_t result(0);
+  std::uintptr_t resume(0);
+  auto visited = [&resume](const header::Free *f) {
+    return reinterpret_cast<std::uintptr_t>(f) < resume;
+  };
+next_batch:
+  header::Free *batch[BATCH];
+  std::size_t length(0);
+  bool more(false);
+  {
+    std::lock_guard<std::mutex> guard(state.free_lock);
+    header::Free *current =
+        tree::lower_bound<header::Free, ByAddress>(state.free_address, visited);
+  next:
+    if (current && length < BATCH) {
+      std::uintptr_t start(0);
+      std::uintptr_t end(0);
+      if (!current->purged &&
+          current->freed_at + SP_MALLOC_PURGE_DECAY_MS <= now &&
+          purge_bounds(current, start, end)) {
+        batch[length++] = current;
+      }
+      resume = reinterpret_cast<std::uintptr_t>(current) + 1;
+      current = tree::lower_bound<header::Free, ByAddress>(state.free_address,
+                                                          visited);
+      goto next;
+    }
+    more = current != nullptr;
+
+    for (std::size_t i = 0; i < length; ++i) {
+      free_remove(state, batch[i]);
+    }
+  }
+
+  for (std::size_t i = 0; i < length; ++i) {
+    purge_range(batch[i]);
+    result += header::free_length(batch[i]);
+    return_free(state, batch[i]);
+  }
+
+  if (more) {
+    goto next_batch;
+  }
+  return result;
+} // global::purge()
 
 } // namespace global
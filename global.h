@@ -3,20 +3,58 @@
 
 #include "shared.h"
 
+/*
+ * The global layer is a page allocator, every span it hands out or takes back
+ * is page aligned and a whole number of pages.
+ */
 namespace global {
 
 header::Free *
-find_free(State &, sp::node_size) noexcept;
+find_free(State &, sp::pages) noexcept;
+
+/* Link @arenas into a ring of siblings and spread them over the NUMA nodes,
+ * arena i is placed on node i % min(numa::nodes(), @length). When the free
+ * ranges of an arena are exhausted alloc() steals from its siblings on the
+ * same node before growing the arena. Ranges are returned by dealloc() to the
+ * arena whose reservation contains them regardless of the arena of the
+ * caller, ranges outside of every reservation are kept by the caller.
+ */
+void
+link(State *arenas, std::size_t length) noexcept;
+
+/* The arena for a thread running on NUMA @node, threads on the same node are
+ * spread over the arenas of the node by @seq.
+ */
+State &
+arena_of(State *arenas, std::size_t length, std::size_t node,
+         std::size_t seq) noexcept;
 
 void *
-alloc(State &, sp::node_size) noexcept;
+alloc(State &, sp::pages) noexcept;
+
+/* @param[in] alignment   a power of two multiple of the page size
+ */
+void *
+alloc(State &, sp::pages, std::size_t alignment) noexcept;
 
 void
-dealloc(State &, void *, sp::node_size) noexcept;
+dealloc(State &, void *, sp::pages) noexcept;
 
+/* Every LocalFree in the list must be a span of whole pages.
+ */
 void
 dealloc(State &, header::LocalFree *) noexcept;
 
+/* Return the pages of the free ranges which have been idle for at least
+ * SP_MALLOC_PURGE_DECAY_MS at @now to the OS, called periodically by
+ * dealloc().
+ *
+ * @param[in] now     util::monotonic_ms()
+ * @return            the number of bytes in the purged ranges
+ */
+std::size_t
+purge(State &, std::uint64_t now) noexcept;
+
 } // namespace global
 
 #endif
@@ -0,0 +1,124 @@
+#include "large.h"
+
+#include "pagemap.h"
+#include <cassert>
+#include <sys/mman.h> //mmap
+
+static sp::pages
+pages_for(std::size_t length) noexcept {
+  return sp::pages(util::round_up(length, SP_MALLOC_PAGE_SIZE) >>
+                   SP_MALLOC_PAGE_SHIFT);
+} // ::pages_for()
+
+static std::size_t
+length_of(sp::pages pages) noexcept {
+  return std::size_t(pages) << SP_MALLOC_PAGE_SHIFT;
+} // ::length_of()
+
+namespace large {
+
+bool
+is_large(std::size_t length) noexcept {
+  return length > SP_MALLOC_LARGE_THRESHOLD;
+} // large::is_large()
+
+void *
+alloc(std::size_t length) noexcept {
+  assert(is_large(length));
+  const sp::pages pages = pages_for(length);
+
+  void *const result = ::mmap(nullptr, length_of(pages), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (result == MAP_FAILED) {
+    return nullptr;
+  }
+
+  if (!pagemap::insert_large(result, pages)) {
+    ::munmap(result, length_of(pages));
+    return nullptr;
+  }
+  return result;
+} // large::alloc()
+
+bool
+free(void *const ptr) noexcept {
+  auto pages = pagemap::lookup_large(ptr);
+  if (pages) {
+    // unregister first so that a new mapping at the same address is not
+    // unregistered by us
+    pagemap::remove_large(ptr);
+    ::munmap(ptr, length_of(pages.get()));
+    return true;
+  }
+  return false;
+} // large::free()
+
+sp::maybe<std::size_t>
+usable_size(void *const ptr) noexcept {
+  auto pages = pagemap::lookup_large(ptr);
+  if (pages) {
+    return sp::maybe<std::size_t>(length_of(pages.get()));
+  }
+  return {};
+} // large::usable_size()
+
+sp::maybe<void *>
+realloc(void *const ptr, std::size_t length) noexcept {
+  assert(length > 0);
+  auto pages = pagemap::lookup_large(ptr);
+  if (pages) {
+    const sp::pages current = pages.get();
+    const sp::pages wanted = pages_for(length);
+    if (wanted == current) {
+      return sp::maybe<void *>(ptr);
+    }
+
+    // the kernel moves the page table entries so only the pages touched are
+    // paid for, not the length of the allocation. Shrinking releases the tail
+    // pages in place, also when @length is no longer a large length. The
+    // entry of @ptr is already allocated in the page map so registering a new
+    // length for @ptr only fails when it is too large to be recorded.
+    if (::mremap(ptr, length_of(current), length_of(wanted), 0) !=
+        MAP_FAILED) {
+      if (pagemap::insert_large(ptr, wanted)) {
+        return sp::maybe<void *>(ptr);
+      }
+      // grown in place, give back the new pages and keep @ptr as it was
+      ::mremap(ptr, length_of(wanted), length_of(current), 0);
+      return sp::maybe<void *>(nullptr);
+    }
+    assert(wanted > current);
+
+    // The destination is mapped and registered before any page is moved, when
+    // either fails @ptr is still mapped and registered as it was.
+    void *const result = ::mmap(nullptr, length_of(wanted),
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) {
+      return sp::maybe<void *>(nullptr);
+    }
+    if (!pagemap::insert_large(result, wanted)) {
+      ::munmap(result, length_of(wanted));
+      return sp::maybe<void *>(nullptr);
+    }
+
+    // the pages of @ptr replace the start of the destination mapping. @ptr
+    // is unregistered first so that a new mapping at the same address is not
+    // unregistered by us
+    pagemap::remove_large(ptr);
+    void *const moved =
+        ::mremap(ptr, length_of(current), length_of(current),
+                 MREMAP_MAYMOVE | MREMAP_FIXED, result);
+    if (moved == MAP_FAILED) {
+      pagemap::remove_large(result);
+      ::munmap(result, length_of(wanted));
+      pagemap::insert_large(ptr, current);
+      return sp::maybe<void *>(nullptr);
+    }
+    assert(moved == result);
+    return sp::maybe<void *>(result);
+  }
+  return {};
+} // large::realloc()
+
+} // namespace large
@@ -0,0 +1,43 @@
+#ifndef SP_MALLOC_LARGE_H
+#define SP_MALLOC_LARGE_H
+
+#include "shared.h"
+
+/*
+ * Allocations larger than SP_MALLOC_LARGE_THRESHOLD are not served from the
+ * pools. Each gets its own anonymous mapping of the length rounded up to whole
+ * pages, which is recorded in the page map so that free, usable_size and
+ * realloc only need a single lookup. The mapping is returned to the OS as soon
+ * as it is freed.
+ */
+namespace large {
+
+bool
+is_large(std::size_t length) noexcept;
+
+void *
+alloc(std::size_t length) noexcept;
+
+/* @return            true if @ptr was a large allocation which is now freed
+ */
+bool
+free(void *ptr) noexcept;
+
+/* @return            Maybe the usable size of the large allocation @ptr
+ */
+sp::maybe<std::size_t>
+usable_size(void *ptr) noexcept;
+
+/* Grow or shrink the large allocation @ptr to @length by remapping its pages
+ * instead of copying them, a shrink never moves the allocation.
+ *
+ * @return            nothing if @ptr is not a large allocation, otherwise
+ *                    the resized allocation or nullptr when out of memory,
+ *                    in which case @ptr is left as it was
+ */
+sp::maybe<void *>
+realloc(void *ptr, std::size_t length) noexcept;
+
+} // namespace large
+
+#endif
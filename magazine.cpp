@@ -0,0 +1,111 @@
+#include "magazine.h"
+#include "alloc.h"
+#include "free.h"
+#include "pagemap.h"
+#include <algorithm>
+#include <cassert>
+
+//==PRIVATE=================================================================
+static void
+flush_oldest(global::State &global, local::PoolsRAII &pools,
+             local::Magazine &magazine, std::size_t length) noexcept {
+  using shared::FreeCode;
+  assert(length <= magazine.length);
+
+  shared::State state(global, pools, pools);
+  for (std::size_t i(0); i < length; ++i) {
+    const FreeCode code = shared::free(state, magazine.entries[i]);
+    assert(code == FreeCode::FREED || code == FreeCode::FREED_RECLAIM);
+    (void)code;
+  }
+
+  std::copy(magazine.entries + length, magazine.entries + magazine.length,
+            magazine.entries);
+  magazine.length -= length;
+} // ::flush_oldest()
+
+static bool
+refill(global::State &global, local::PoolsRAII &pools, std::size_t index,
+       local::Magazine &magazine) noexcept {
+  assert(magazine.length == 0);
+  const std::size_t reserved = shared::alloc_batch(
+      global, pools, index, magazine.entries, SP_MALLOC_MAGAZINE_BATCH);
+  // the first reserved bucket is on the top of the stack
+  std::reverse(magazine.entries, magazine.entries + reserved);
+  magazine.length = reserved;
+
+  return reserved > 0;
+} // ::refill()
+
+//==PUBLIC==================================================================
+namespace magazine {
+
+void *
+alloc(global::State &global, local::PoolsRAII &pools,
+      std::size_t length) noexcept {
+  assert(pools.reclaim.load() == false);
+  const std::size_t index = shared::size_class_index(length);
+  if (index < SP_MALLOC_MAGAZINE_CLASSES) {
+    local::Magazine &magazine = pools.magazines[index];
+    if (magazine.length > 0 || refill(global, pools, index, magazine)) {
+      return magazine.entries[--magazine.length];
+    }
+  }
+
+  return shared::alloc(global, pools, length);
+} // magazine::alloc()
+
+shared::FreeCode
+free(global::State &global, local::PoolsRAII &pools, void *const ptr) noexcept {
+  using shared::FreeCode;
+  auto entry = pagemap::lookup(ptr);
+  if (!entry || entry.get().owner != &pools) {
+    return FreeCode::NOT_FOUND;
+  }
+
+  header::Node *const node = entry.get().node;
+  const std::size_t index = node->size_class;
+  if (index >= SP_MALLOC_MAGAZINE_CLASSES) {
+    return FreeCode::NOT_FOUND;
+  }
+
+  const std::uintptr_t data_start = header::node_data_start(node);
+  const std::uintptr_t search = reinterpret_cast<std::uintptr_t>(ptr);
+  if (search < data_start) {
+    return FreeCode::NOT_FOUND;
+  }
+  auto bucket = header::bucket_index(node, search - data_start);
+  if (!bucket || !(bucket.get() < node->buckets)) {
+    return FreeCode::NOT_FOUND;
+  }
+
+  // We are the only thread reserving buckets in our own extents, so an
+  // unreserved bucket can not become reserved concurrently.
+  header::Extent *const extent = header::extent(node);
+  if (!extent->reserved.test(std::size_t(bucket.get()))) {
+    return FreeCode::DOUBLE_FREE;
+  }
+
+  local::Magazine &magazine = pools.magazines[index];
+  for (std::size_t i(0); i < magazine.length; ++i) {
+    if (magazine.entries[i] == ptr) {
+      return FreeCode::DOUBLE_FREE;
+    }
+  }
+
+  if (magazine.length == SP_MALLOC_MAGAZINE_SIZE) {
+    flush_oldest(global, pools, magazine, SP_MALLOC_MAGAZINE_BATCH);
+  }
+  magazine.entries[magazine.length++] = ptr;
+
+  return FreeCode::FREED;
+} // magazine::free()
+
+void
+flush(global::State &global, local::PoolsRAII &pools) noexcept {
+  for (auto &magazine : pools.magazines) {
+    flush_oldest(global, pools, magazine, magazine.length);
+  }
+} // magazine::flush()
+
+} // namespace magazine
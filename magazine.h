@@ -0,0 +1,37 @@
+#ifndef SP_MALLOC_MAGAZINE_H
+#define SP_MALLOC_MAGAZINE_H
+
+#include "shared.h"
+
+/*
+ * Thread local LIFO cache of buckets for the small size classes in front of
+ * the Extent bitsets. Buckets in a magazine are still reserved in their
+ * Extent, they are refilled and flushed in batches of SP_MALLOC_MAGAZINE_BATCH.
+ *
+ * Only the thread owning the PoolsRAII may use its magazines.
+ */
+namespace magazine {
+
+/* Pop a bucket for @length from the magazine, refilling it when empty. Falls
+ * back to shared::alloc() for size classes without a magazine.
+ */
+void *
+alloc(global::State &, local::PoolsRAII &, std::size_t length) noexcept;
+
+/* Push @ptr onto its magazine if it is a reserved bucket owned by @pools,
+ * flushing the oldest half of a full magazine.
+ *
+ * @return            FREED if @ptr was cached, DOUBLE_FREE if @ptr is
+ *                    already free, NOT_FOUND if @ptr can not be cached
+ */
+shared::FreeCode
+free(global::State &, local::PoolsRAII &, void *ptr) noexcept;
+
+/* Returns all cached buckets to their Extent.
+ */
+void
+flush(global::State &, local::PoolsRAII &) noexcept;
+
+} // namespace magazine
+
+#endif
@@ -1,5 +1,7 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstring>
 
 #ifdef SP_TEST
 #include "malloc_debug.h"
@@ -7,7 +9,11 @@
 
 #include "alloc.h"
 #include "free.h"
+#include "global.h"
+#include "large.h"
+#include "magazine.h"
 #include "malloc.h"
+#include "numa.h"
 #include "shared.h"
 #include "stuff.h"
 
@@ -19,10 +25,6 @@
 // node header like Thread id to make global::free easier.
 // `node::Header header_for(ptr);`
 
-// - use memmap instead of sbrk to more freely allow for reclamation of
-// large unused ranges of global free-list memory. Without being blocked by a
-// single high sbrk reservation.
-
 // sp::RefCounter Pools in global
 
 // # TODO
@@ -31,9 +33,7 @@
 //  * local::malloc coalesce local free list
 //  * only single mallocing thread is allowed the dequeuing
 //  * multiple free threads is allowed to enqueue
-//  * high & low watermark on free list size based on total allocated by thread
 //  * global::alloc(minimum, desired) desired size is optional to fulfil
-//  * local -> global free list reclamation based on high watermark
 //
 // 2. Local pool reclamation from global
 //  * Non-thread local free()
@@ -53,7 +53,6 @@
 //
 // 5. global::free_list
 //  *  (shrinking/reclamation/release/dealloc) reclaim usuable mem to sbrk
-//  * change interface for global::alloc to N 4096 pages not X bytes
 //
 // 9. global::free_list
 //  * how to better coalesce global::free_list pages
@@ -78,10 +77,6 @@
 // TODO optimizations
 // - Some kind of TL cache with a reference to the most referenced Pools used
 // for non-TL free:ing.
-// - A range of the highest & lowest memory address used to determine if it is
-// necessary to walk through the Nodes
-//    - on PoolsRAII level
-//    - on Pool level
 // - An optimized collections of Pool:s used for free:ing in addition to the
 //   Pool[60] used for allocating. balanced tree for Pool which are non-empty.
 // - skip TL Pool when iterating global::free() since we have already handled
@@ -102,16 +97,31 @@
 // - implement malloc interface
 // - LD_PRELUDE
 // - benchmark
-//
-// TODO change to mmap with one big area so we sp_malloc can coexist with another
-// malloc without interfering with it by changing brk()
 
 // thread local Pools {{{
 static thread_local local::Pools local_pools;
 // }}}
 
-// global memory Arena {{{
-static global::State global_state;
+// global memory Arenas {{{
+// Threads are assigned an arena on the NUMA node they first run on and are
+// spread round-robin over the arenas of that node to avoid contending on a
+// single free list, see global::link()
+static global::State global_arenas[SP_MALLOC_ARENAS];
+static const bool global_linked =
+    (global::link(global_arenas, SP_MALLOC_ARENAS), true);
+static std::atomic<std::size_t> global_next_arena(0);
+
+static global::State &
+arena_for(local::Pools &lpools) noexcept {
+  assert(global_linked);
+  if (!lpools.global) {
+    const std::size_t seq =
+        global_next_arena.fetch_add(1, std::memory_order_relaxed);
+    lpools.global = &global::arena_of(global_arenas, SP_MALLOC_ARENAS,
+                                      numa::current(), seq);
+  }
+  return *lpools.global;
+} // ::arena_for()
 // }}}
 
 /*
@@ -139,12 +149,18 @@ malloc_count_alloc(std::size_t sz) {
 
 void
 force_reclaim_orphan_tl() {
-  stuff_force_reclaim_orphan(global_state);
+  stuff_force_reclaim_orphan(arena_for(local_pools));
 } // debug::force_reclaim_orphan_tl()
 
 std::vector<std::tuple<void *, std::size_t>>
 global_get_free() {
-  return global_get_free(global_state);
+  std::vector<std::tuple<void *, std::size_t>> result;
+  for (auto &arena : global_arenas) {
+    auto free = global_get_free(arena);
+    result.insert(result.end(), free.begin(), free.end());
+  }
+  std::sort(result.begin(), result.end());
+  return result;
 } // debug::global_get_free()
 
 } // namespace debug
@@ -160,10 +176,16 @@ sp_malloc(std::size_t length) noexcept {
     return nullptr;
   }
 
+  if (large::is_large(length)) {
+    return large::alloc(length);
+  }
+
   auto &lpools = local_pools;
-  lpools.init(global_state);
+  global::State &arena = arena_for(lpools);
+  lpools.init(arena);
+  assert(lpools.pools);
 
-  return shared::alloc(global_state, lpools, length);
+  return magazine::alloc(arena, *lpools.pools, length);
 } // ::sp_malloc()
 
 bool
@@ -172,18 +194,26 @@ sp_free(void *const ptr) noexcept {
     return true;
   }
 
+  if (large::free(ptr)) {
+    return true;
+  }
+
   using shared::FreeCode;
   auto result = FreeCode::NOT_FOUND;
 
   auto &lpools = local_pools;
+  global::State &arena = arena_for(lpools);
   if (lpools.pools) {
-    shared::State state(global_state, local_pools, local_pools);
-    result = shared::free(state, ptr);
+    result = magazine::free(arena, *lpools.pools, ptr);
+    if (result == FreeCode::NOT_FOUND) {
+      shared::State state(arena, local_pools, local_pools);
+      result = shared::free(state, ptr);
+    }
     assert(result != FreeCode::FREED_RECLAIM);
   }
 
   if (result == FreeCode::NOT_FOUND) {
-    result = global::free(global_state, lpools, ptr);
+    result = global::free(arena, lpools, ptr);
   }
 
   return result == FreeCode::FREED || result == FreeCode::FREED_RECLAIM;
@@ -195,6 +225,11 @@ sp_usable_size(void *const ptr) noexcept {
     return 0;
   }
 
+  auto large_size = large::usable_size(ptr);
+  if (large_size) {
+    return large_size.get();
+  }
+
   auto &lpools = local_pools;
   if (lpools.pools) {
     auto result = shared::usable_size(lpools, ptr);
@@ -218,17 +253,34 @@ sp_realloc(void *const ptr, std::size_t length) noexcept {
     return nullptr;
   }
 
+  auto large_result = large::realloc(ptr, length);
+  if (large_result) {
+    return large_result.get();
+  }
+
+  if (large::is_large(length)) {
+    // grows out of the pools into a dedicated mapping
+    const std::size_t current = sp_usable_size(ptr);
+    void *const result = large::alloc(length);
+    if (result) {
+      std::memcpy(result, ptr, current);
+      sp_free(ptr);
+    }
+    return result;
+  }
+
   auto nop = shared::FreeCode::NOT_FOUND;
   // TODO only required init() when length < bucket->size
-  local_pools.init(global_state);
-  shared::State state(global_state, local_pools, local_pools);
+  global::State &arena = arena_for(local_pools);
+  local_pools.init(arena);
+  shared::State state(arena, local_pools, local_pools);
   auto lresult = shared::realloc(state, ptr, length, nop);
   if (lresult) {
     return lresult.get();
   }
   assert(nop == shared::FreeCode::NOT_FOUND);
 
-  auto result = global::realloc(global_state, local_pools, ptr, length);
+  auto result = global::realloc(arena, local_pools, ptr, length);
   void *const def = nullptr;
   return result.get_or(def);
 } //::sp_realloc
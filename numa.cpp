@@ -0,0 +1,121 @@
+#include "numa.h"
+
+#include <atomic>
+#include <fcntl.h>  //open
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h> //read
+
+#ifdef SP_TEST
+#include "numa_debug.h"
+#endif
+
+namespace numa {
+// 0 until the topology has been read
+static std::atomic<std::size_t> online(0);
+#ifdef SP_TEST
+static std::atomic<std::size_t> fake_nodes(0);
+static thread_local std::size_t fake_current(0);
+#endif
+
+// The online nodes are listed as ranges like "0" or "0-1,4-7", the number of
+// nodes is the highest node + 1. Nodes which are possible but not online have
+// no memory to bind to. Read with plain system calls since this can run before
+// anything else is initialized.
+static std::size_t
+read_online() noexcept {
+  const int fd = ::open("/sys/devices/system/node/online", O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+
+  char buffer[256];
+  const ssize_t length = ::read(fd, buffer, sizeof(buffer));
+  ::close(fd);
+
+  std::size_t highest(0);
+  std::size_t number(0);
+  for (ssize_t i = 0; i < length; ++i) {
+    const char c = buffer[i];
+    if (c >= '0' && c <= '9') {
+      number = (number * 10) + std::size_t(c - '0');
+    } else {
+      highest = number > highest ? number : highest;
+      number = 0;
+    }
+  }
+  highest = number > highest ? number : highest;
+
+  return highest + 1;
+} // numa::read_online()
+
+std::size_t
+nodes() noexcept {
+#ifdef SP_TEST
+  const std::size_t fake = fake_nodes.load(std::memory_order_relaxed);
+  if (fake) {
+    return fake;
+  }
+#endif
+  std::size_t result = online.load(std::memory_order_relaxed);
+  if (result == 0) {
+    // racing readers compute the same value
+    result = read_online();
+    online.store(result, std::memory_order_relaxed);
+  }
+  return result;
+} // numa::nodes()
+
+std::size_t
+current() noexcept {
+#ifdef SP_TEST
+  if (fake_nodes.load(std::memory_order_relaxed)) {
+    return fake_current;
+  }
+#endif
+  unsigned cpu(0);
+  unsigned node(0);
+  if (::syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return 0;
+  }
+  const std::size_t length = nodes();
+  return std::size_t(node) < length ? std::size_t(node) : 0;
+} // numa::current()
+
+bool
+bind(void *start, std::size_t length, std::size_t node) noexcept {
+#ifdef SP_TEST
+  if (fake_nodes.load(std::memory_order_relaxed)) {
+    return true;
+  }
+#endif
+  if (nodes() <= 1) {
+    return true;
+  }
+
+  constexpr std::size_t BITS = sizeof(unsigned long) * 8;
+  // large enough for the node limit of the kernel (CONFIG_NODES_SHIFT=10)
+  unsigned long mask[1024 / BITS] = {0};
+  if (node >= sizeof(mask) * 8) {
+    return false;
+  }
+  mask[node / BITS] = 1ul << (node % BITS);
+
+  // preferred rather than strict, when the node is out of memory it is
+  // better to fall back to a remote node than to fail the page fault
+  return ::syscall(SYS_mbind, start, length, MPOL_PREFERRED, mask,
+                   sizeof(mask) * 8, 0) == 0;
+} // numa::bind()
+
+} // namespace numa
+
+//=======DEBUG===============================================
+#ifdef SP_TEST
+namespace debug {
+void
+numa_fake_topology(std::size_t nodes, std::size_t current) noexcept {
+  numa::fake_current = current;
+  numa::fake_nodes.store(nodes, std::memory_order_relaxed);
+} // debug::numa_fake_topology()
+} // namespace debug
+#endif
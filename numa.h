@@ -0,0 +1,34 @@
+#ifndef SP_MALLOC_NUMA_H
+#define SP_MALLOC_NUMA_H
+
+#include <cstddef>
+
+/*
+ * Minimal NUMA topology used to place the global arenas, the system calls are
+ * made directly to not depend on libnuma. On a machine without NUMA support
+ * everything is node 0 of a single node topology.
+ */
+namespace numa {
+
+/* The number of online NUMA nodes, at least 1.
+ */
+std::size_t
+nodes() noexcept;
+
+/* The NUMA node the calling thread currently runs on, less than nodes().
+ */
+std::size_t
+current() noexcept;
+
+/* Set the memory policy of the mapped range [@start, @start + @length) to
+ * prefer @node, pages faulted in later are allocated on @node when it has
+ * free memory. Nothing is done for a single node topology.
+ *
+ * @return            false if the policy could not be applied
+ */
+bool
+bind(void *start, std::size_t length, std::size_t node) noexcept;
+
+} // namespace numa
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef SP_MALLOC_NUMA_DEBUG_H
+#define SP_MALLOC_NUMA_DEBUG_H
+
+#include "numa.h"
+
+namespace debug {
+
+/* Override the topology with @nodes nodes where the calling thread runs on
+ * @current, bind() becomes a no-op. A @nodes of 0 restores the real topology.
+ */
+void
+numa_fake_topology(std::size_t nodes, std::size_t current) noexcept;
+
+} // namespace debug
+
+#endif
@@ -0,0 +1,226 @@
+#include "pagemap.h"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <sys/mman.h> //mmap
+
+// 48 bit virtual address space split into 12 bits of page offset and
+// 3 x 12 bits of radix tree index [root][mid][leaf]
+#define SP_MALLOC_PAGE_MAP_ADDRESS_BITS std::size_t(48)
+#define SP_MALLOC_PAGE_MAP_PAGE_BITS std::size_t(12)
+#define SP_MALLOC_PAGE_MAP_LEVEL_BITS std::size_t(12)
+
+static_assert((std::size_t(1) << SP_MALLOC_PAGE_MAP_PAGE_BITS) ==
+                  SP_MALLOC_PAGE_SIZE,
+              "");
+static_assert(SP_MALLOC_PAGE_MAP_PAGE_BITS +
+                      (SP_MALLOC_PAGE_MAP_LEVEL_BITS * 3) ==
+                  SP_MALLOC_PAGE_MAP_ADDRESS_BITS,
+              "");
+
+namespace pagemap {
+static constexpr std::size_t LEVEL_LENGTH = std::size_t(1)
+                                            << SP_MALLOC_PAGE_MAP_LEVEL_BITS;
+// a page entry is the alignment shift of the extent, 0 when not mapped
+struct Leaf {
+  std::atomic<std::uint8_t> pages[LEVEL_LENGTH];
+  // the length in pages of the large allocation starting at the page, only
+  // touched for large allocations so the memory is mostly never faulted in
+  std::atomic<std::uint32_t> large[LEVEL_LENGTH];
+};
+
+struct Mid {
+  std::atomic<Leaf *> leafs[LEVEL_LENGTH];
+};
+
+static std::atomic<Mid *> root[LEVEL_LENGTH];
+static std::atomic<bool> incomplete(false);
+
+template <typename T>
+static T *
+map_level() noexcept {
+  // anonymous mappings are zero filled which is the initial state of a level
+  void *const raw = ::mmap(nullptr, sizeof(T), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return nullptr;
+  }
+  return reinterpret_cast<T *>(raw);
+} // pagemap::map_level()
+
+template <typename T>
+static T *
+level(std::atomic<T *> &slot, bool create) noexcept {
+  T *current = slot.load(std::memory_order_acquire);
+  if (!current && create) {
+    T *const fresh = map_level<T>();
+    if (fresh) {
+      if (slot.compare_exchange_strong(current, fresh)) {
+        current = fresh;
+      } else {
+        // some other thread installed the level first
+        ::munmap(fresh, sizeof(T));
+      }
+    }
+  }
+  return current;
+} // pagemap::level()
+
+static Leaf *
+page_leaf(std::uintptr_t page, bool create) noexcept {
+  constexpr std::size_t mask = LEVEL_LENGTH - 1;
+  constexpr std::size_t bits = SP_MALLOC_PAGE_MAP_LEVEL_BITS;
+  if ((page >> (bits * 3)) != 0) {
+    // outside of the supported address space
+    return nullptr;
+  }
+
+  Mid *const mid = level(root[(page >> (bits * 2)) & mask], create);
+  if (mid) {
+    return level(mid->leafs[(page >> bits) & mask], create);
+  }
+  return nullptr;
+} // pagemap::page_leaf()
+
+static std::atomic<std::uint8_t> *
+page_entry(std::uintptr_t page, bool create) noexcept {
+  Leaf *const leaf = page_leaf(page, create);
+  if (leaf) {
+    return &leaf->pages[page & (LEVEL_LENGTH - 1)];
+  }
+  return nullptr;
+} // pagemap::page_entry()
+
+static std::atomic<std::uint32_t> *
+large_entry(void *const start, bool create) noexcept {
+  const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(start);
+  if (address % SP_MALLOC_PAGE_SIZE != 0) {
+    return nullptr;
+  }
+
+  const std::uintptr_t page = address >> SP_MALLOC_PAGE_MAP_PAGE_BITS;
+  Leaf *const leaf = page_leaf(page, create);
+  if (leaf) {
+    return &leaf->large[page & (LEVEL_LENGTH - 1)];
+  }
+  return nullptr;
+} // pagemap::large_entry()
+
+template <typename F>
+static bool
+for_each_page(header::Node *const node, bool create, F f) noexcept {
+  const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(node);
+  const std::uintptr_t end = start + std::size_t(node->node_size);
+  assert(start % SP_MALLOC_PAGE_SIZE == 0);
+  assert(end % SP_MALLOC_PAGE_SIZE == 0);
+  assert(end > start);
+
+  bool result = true;
+  for (std::uintptr_t page = start >> SP_MALLOC_PAGE_MAP_PAGE_BITS;
+       page < (end >> SP_MALLOC_PAGE_MAP_PAGE_BITS); ++page) {
+    std::atomic<std::uint8_t> *const entry = page_entry(page, create);
+    if (entry) {
+      f(*entry);
+    } else {
+      result = false;
+    }
+  }
+  return result;
+} // pagemap::for_each_page()
+
+/*Entry*/
+Entry::Entry() noexcept
+    : Entry(nullptr, nullptr) {
+}
+
+Entry::Entry(header::Node *n, local::PoolsRAII *o) noexcept
+    : node(n)
+    , owner(o) {
+}
+
+bool
+insert(header::Node *const node) noexcept {
+  assert(node);
+  assert(node->owner);
+  assert(node->type == header::NodeType::HEAD);
+
+  const std::size_t alignment = header::extent_alignment(node->node_size);
+  assert(reinterpret_cast<std::uintptr_t>(node) % alignment == 0);
+
+  const std::uint8_t shift = std::uint8_t(util::trailing_zeros(alignment));
+  const bool result = for_each_page(node, true, [&](auto &entry) {
+    entry.store(shift, std::memory_order_release);
+  });
+
+  if (!result) {
+    incomplete.store(true);
+  }
+  return result;
+} // pagemap::insert()
+
+void
+remove(header::Node *const node) noexcept {
+  assert(node);
+  for_each_page(node, false, [](auto &entry) { //
+    entry.store(0, std::memory_order_release);
+  });
+} // pagemap::remove()
+
+sp::maybe<Entry>
+lookup(void *const ptr) noexcept {
+  const std::uintptr_t search = reinterpret_cast<std::uintptr_t>(ptr);
+  std::atomic<std::uint8_t> *const entry =
+      page_entry(search >> SP_MALLOC_PAGE_MAP_PAGE_BITS, false);
+  if (entry) {
+    const std::uint8_t shift = entry->load(std::memory_order_acquire);
+    if (shift) {
+      header::Node *const node = header::node(ptr, std::size_t(1) << shift);
+
+      return sp::maybe<Entry>(Entry(node, node->owner));
+    }
+  }
+  return {};
+} // pagemap::lookup()
+
+bool
+insert_large(void *const start, sp::pages pages) noexcept {
+  assert(start);
+  assert(pages > 0);
+  if (std::size_t(pages) > UINT32_MAX) {
+    return false;
+  }
+
+  std::atomic<std::uint32_t> *const entry = large_entry(start, true);
+  if (entry) {
+    entry->store(std::uint32_t(pages), std::memory_order_release);
+    return true;
+  }
+  return false;
+} // pagemap::insert_large()
+
+void
+remove_large(void *const start) noexcept {
+  std::atomic<std::uint32_t> *const entry = large_entry(start, false);
+  if (entry) {
+    entry->store(0, std::memory_order_release);
+  }
+} // pagemap::remove_large()
+
+sp::maybe<sp::pages>
+lookup_large(void *const ptr) noexcept {
+  std::atomic<std::uint32_t> *const entry = large_entry(ptr, false);
+  if (entry) {
+    const std::uint32_t pages = entry->load(std::memory_order_acquire);
+    if (pages) {
+      return sp::maybe<sp::pages>(sp::pages(pages));
+    }
+  }
+  return {};
+} // pagemap::lookup_large()
+
+bool
+is_complete() noexcept {
+  return !incomplete.load(std::memory_order_acquire);
+} // pagemap::is_complete()
+
+} // namespace pagemap
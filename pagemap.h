@@ -0,0 +1,77 @@
+#ifndef SP_MALLOC_PAGE_MAP_H
+#define SP_MALLOC_PAGE_MAP_H
+
+#include "shared.h"
+
+/*
+ * Process wide radix tree mapping the address of a page to the extent covering
+ * it. Extents are naturally aligned (see header::extent_alignment()) and a
+ * multiple of the page size, so a page belongs to at most one extent and only
+ * the alignment of the extent is stored. The Node header is found by masking
+ * the pointer and the owner is read from the Node.
+ *
+ * Readers are lock free, writers are the owner of the extent which registers
+ * it in header::init_extent() and removes it when the extent is unlinked for
+ * recycling.
+ *
+ * Large allocations which bypass the pools are recorded separately by their
+ * first page together with their length, see large.h.
+ */
+namespace pagemap {
+
+struct Entry {
+  header::Node *node;
+  local::PoolsRAII *owner;
+
+  Entry() noexcept;
+  Entry(header::Node *, local::PoolsRAII *) noexcept;
+};
+
+/* Registers all pages spanned by @node. Fails only when memory for the radix
+ * tree could not be mapped, in that case the page map is marked as incomplete
+ * and lookups that miss can no longer be trusted.
+ *
+ * @param[in] node    The HEAD node of the extent with its owner set
+ * @return            true if all pages was registered
+ */
+bool
+insert(header::Node *) noexcept;
+
+void
+remove(header::Node *) noexcept;
+
+/* Lookup the extent which contains @ptr.
+ *
+ * @param[in] ptr     Any pointer
+ * @return            Maybe the extent containing @ptr and its owner
+ */
+sp::maybe<Entry>
+lookup(void *) noexcept;
+
+/* Registers the large allocation mapped at [@start, @start + @pages), only
+ * @start can be looked up with lookup_large().
+ *
+ * @return            false if the large allocation could not be registered
+ */
+bool
+insert_large(void *start, sp::pages) noexcept;
+
+void
+remove_large(void *start) noexcept;
+
+/* Lookup the large allocation starting at @ptr.
+ *
+ * @param[in] ptr     Any pointer
+ * @return            Maybe the length in pages of the large allocation
+ */
+sp::maybe<sp::pages>
+lookup_large(void *) noexcept;
+
+/* When true a miss in lookup() means that @ptr is not owned by any extent.
+ */
+bool
+is_complete() noexcept;
+
+} // namespace pagemap
+
+#endif
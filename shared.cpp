@@ -1,8 +1,12 @@
 #include "global.h"
+#include "pagemap.h"
 #include "shared.h"
 #include "stuff.h"
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstring>
+#include <utility>
 
 //========sp=============================================
 #ifdef SP_TYPED_NUMERIC
@@ -43,14 +47,16 @@ namespace header {
 static_assert(sizeof(Free) == SP_MALLOC_CACHE_LINE_SIZE, "");
 static_assert(alignof(Free) == SP_MALLOC_CACHE_LINE_SIZE, "");
 
-Free::Free(sp::node_size sz, Free *nxt) noexcept
-    : next_lock{}
-    , size(sz)
-    , next(nxt) {
-}
-
-Free::Free(sp::node_size sz) noexcept
-    : Free(sz, nullptr) {
+Free::Free(sp::pages length) noexcept
+    : pages(length)
+    , freed_at(util::monotonic_ms())
+    , address_left(nullptr)
+    , address_right(nullptr)
+    , size_left(nullptr)
+    , size_right(nullptr)
+    , address_height(0)
+    , size_height(0)
+    , purged(false) {
 }
 template <typename T>
 static bool
@@ -70,29 +76,51 @@ internal_is_consecutive(const T *const head, const T *const tail) noexcept {
 
 bool
 is_consecutive(const Free *const head, const Free *const tail) noexcept {
-  return internal_is_consecutive(head, tail);
+  assert(head);
+  assert(tail);
+  const std::uintptr_t head_end = page_number(head) + std::size_t(head->pages);
+  const std::uintptr_t tail_start = page_number(tail);
+#ifdef SP_TEST
+  const std::uintptr_t tail_end = tail_start + std::size_t(tail->pages);
+  assert(!(head_end > tail_start && head_end < tail_end));
+  assert(!(tail_end > page_number(head) && tail_end < head_end));
+#endif
+  return head_end == tail_start;
 } // header::is_consecutive()
 
+std::uintptr_t
+page_number(const Free *const free) noexcept {
+  assert(free);
+  return reinterpret_cast<std::uintptr_t>(free) >> SP_MALLOC_PAGE_SHIFT;
+} // header::page_number()
+
+std::size_t
+free_length(const Free *const free) noexcept {
+  assert(free);
+  return std::size_t(free->pages) << SP_MALLOC_PAGE_SHIFT;
+} // header::free_length()
+
 void
-coalesce(Free *head, Free *tail, Free *const next) noexcept {
+coalesce(Free *head, Free *tail) noexcept {
   assert(is_consecutive(head, tail));
-  head->size = head->size + tail->size;
+  head->pages = head->pages + tail->pages;
+  // dirty if any part is dirty, a purge of the whole range is harmless
+  head->purged = head->purged && tail->purged;
+  head->freed_at = std::max(head->freed_at, tail->freed_at);
 #ifdef SP_TEST
-  std::memset(tail, 0, std::size_t(tail->size));
+  std::memset(tail, 0, sizeof(Free));
 #endif
-  head->next.store(next, std::memory_order_relaxed);
 } // header::coalesce()
 
 Free *
-init_free(void *const head, sp::node_size length) noexcept {
+init_free(void *const head, sp::pages length) noexcept {
   if (head && length > 0) {
-    assert(reinterpret_cast<uintptr_t>(head) % alignof(Free) == 0);
-    assert(length >= sizeof(Free));
+    assert(reinterpret_cast<uintptr_t>(head) % SP_MALLOC_PAGE_SIZE == 0);
 #ifdef SP_TEST
-    std::memset(head, 0, std::size_t(length));
+    std::memset(head, 0, std::size_t(length) << SP_MALLOC_PAGE_SHIFT);
 #endif
 
-    return new (head) Free(length, nullptr);
+    return new (head) Free(length);
   }
   return nullptr;
 } // header::init_free()
@@ -114,8 +142,18 @@ ireduce(T *const free, sp::node_size length) noexcept {
 }
 
 Free *
-reduce(Free *const free, sp::node_size length) noexcept {
-  return ireduce(free, length);
+reduce(Free *const free, sp::pages length) noexcept {
+  assert(free->pages > length);
+
+  free->pages = free->pages - length;
+  void *const result =
+      util::ptr_math(free, +std::int64_t(free_length(free)));
+#ifdef SP_TEST
+  std::memset(result, 0, std::size_t(length) << SP_MALLOC_PAGE_SHIFT);
+#endif
+  Free *const tail = new (result) Free(length);
+  tail->purged = free->purged;
+  return tail;
 } // header::reduce()
 
 Free *
@@ -132,10 +170,16 @@ LocalFree::LocalFree(sp::node_size sz) noexcept
     : next{nullptr}
     , priv(nullptr)
     //}}}
-    // tree{{{
+    // tree by address{{{
     , left{nullptr}
     , right(nullptr)
     // }}}
+    // tree by size{{{
+    , size_left{nullptr}
+    , size_right(nullptr)
+    // }}}
+    , height(0)
+    , size_height(0)
     , size{sz} {
 }
 
@@ -178,6 +222,11 @@ is_consecutive(LocalFree *head, LocalFree *tail) noexcept {
   return internal_is_consecutive(head, tail);
 }
 
+/*RemoteFree*/
+RemoteFree::RemoteFree() noexcept
+    : next{nullptr} {
+}
+
 /*Extent*/
 static_assert(sizeof(Extent) == SP_MALLOC_CACHE_LINE_SIZE, "");
 static_assert(alignof(Extent) == SP_MALLOC_CACHE_LINE_SIZE, "");
@@ -216,19 +265,25 @@ static_assert(sizeof(Node) == SP_MALLOC_CACHE_LINE_SIZE, "");
 
 Node::Node(NodeType t, sp::node_size nodeSz, sp::bucket_size bucketSz,
            sp::buckets p_buckets) noexcept //
-    : pad0()
+    : owner(nullptr)
+    , pad0()
     , next{nullptr}
     , bucket_size(bucketSz)
     , node_size(nodeSz)
     , buckets(p_buckets)
     , type(t)
-    , pad1() {
+    , size_class(0)
+    , pad1()
+    , bucket_reciprocal(util::reciprocal(std::size_t(bucketSz)))
+    , pad2() {
 } // Node()
 
 Node *
-init_extent(void *const raw, sp::node_size size,
-            sp::bucket_size bucketSz) noexcept {
+init_extent(void *const raw, sp::node_size size, sp::bucket_size bucketSz,
+            local::PoolsRAII *const owner) noexcept {
   assert(raw != nullptr);
+  assert(owner != nullptr);
+  assert(reinterpret_cast<uintptr_t>(raw) % extent_alignment(size) == 0);
   assert(size >= header::SIZE);
   assert(bucketSz > 0);
   const sp::buckets buckets = calc_buckets(size, bucketSz);
@@ -239,10 +294,16 @@ init_extent(void *const raw, sp::node_size size,
 #endif
   Node *const nHdr = node(raw);
   new (nHdr) Node(NodeType::HEAD, size, bucketSz, buckets);
+  nHdr->owner = owner;
+  nHdr->size_class = std::uint8_t(shared::pool_index(bucketSz));
 
   Extent *const eHdr = extent(nHdr);
   new (eHdr) Extent;
 
+  // if the page map could not be populated the extent is still reachable by
+  // the linear Pool search
+  pagemap::insert(nHdr);
+
   return nHdr;
 } // header::init_node()
 
@@ -254,6 +315,21 @@ node(void *const start) noexcept {
   return reinterpret_cast<Node *>(start);
 } // header::node()
 
+std::size_t
+extent_alignment(sp::node_size size) noexcept {
+  assert(size > 0);
+  return std::max(util::round_even(std::size_t(size)), SP_MALLOC_PAGE_SIZE);
+} // header::extent_alignment()
+
+Node *
+node(void *const ptr, std::size_t alignment) noexcept {
+  assert(ptr != nullptr);
+  assert(util::is_power_of_two(alignment));
+  uintptr_t startPtr = reinterpret_cast<uintptr_t>(ptr);
+  startPtr &= ~(alignment - 1);
+  return node(reinterpret_cast<void *>(startPtr));
+} // header::node()
+
 sp::node_size
 node_data_size(Node *const node) noexcept {
   sp::node_size result = node->node_size;
@@ -277,16 +353,49 @@ node_data_start(Node *const node) noexcept {
   return result;
 } // header::node_data_start()
 
+sp::maybe<sp::index>
+bucket_index(const Node *const node, std::size_t offset) noexcept {
+  const std::size_t bucketSz(node->bucket_size);
+  assert(bucketSz > 0);
+
+  std::size_t index;
+  if (util::is_power_of_two(bucketSz)) {
+    index = offset >> util::trailing_zeros(bucketSz);
+  } else {
+    index = util::divide(offset, node->bucket_reciprocal);
+  }
+
+  if (index * bucketSz != offset) {
+    // not pointing to the start of a bucket
+    return {};
+  }
+  return sp::maybe<sp::index>(index);
+} // header::bucket_index()
+
+void *
+bucket_at(Node *const node, sp::index index) noexcept {
+  const std::uintptr_t data_start = node_data_start(node);
+  return reinterpret_cast<void *>(data_start + (index * node->bucket_size));
+} // header::bucket_at()
+
 } // namespace header
 
 //=======GLOBAL===============================================
 namespace global {
 /*State*/
 State::State() noexcept //
-    : brk_lock{}
-    , brk_position{nullptr}
-    , brk_alloc{0}
-    , free(sp::node_size(0), nullptr)
+    : arena_lock{}
+    , arena_position{0}
+    , arena_end{0}
+    , reservations{}
+    , reservations_length{0}
+    , arena_alloc{0}
+    , node{0}
+    , free_lock{}
+    , free_address{nullptr}
+    , free_size{nullptr}
+    , purge_at{0}
+    , sibling{this}
 #ifdef SP_TEST
     , skip_alloc(false)
 #endif
@@ -297,25 +406,93 @@ State::State() noexcept //
 
 //=======LOCAL===============================================
 namespace local {
+/*Range*/
+Range::Range() noexcept
+    : min{UINTPTR_MAX}
+    , max{0} {
+}
+
+void
+range_extend(Range &range, const header::Node *const node) noexcept {
+  assert(node);
+  const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(node);
+  const std::uintptr_t end = start + std::size_t(node->node_size);
+
+  std::uintptr_t current = range.min.load(std::memory_order_relaxed);
+min_retry:
+  if (start < current) {
+    if (!range.min.compare_exchange_weak(current, start)) {
+      goto min_retry;
+    }
+  }
+
+  current = range.max.load(std::memory_order_relaxed);
+max_retry:
+  if (end > current) {
+    if (!range.max.compare_exchange_weak(current, end)) {
+      goto max_retry;
+    }
+  }
+} // local::range_extend()
+
+void
+range_reset(Range &range, const header::Node *current) noexcept {
+  std::uintptr_t min = UINTPTR_MAX;
+  std::uintptr_t max = 0;
+start:
+  if (current) {
+    if (current->type != header::NodeType::SPECIAL) {
+      const std::uintptr_t node = reinterpret_cast<std::uintptr_t>(current);
+      min = std::min(min, node);
+      max = std::max(max, node + std::size_t(current->node_size));
+    }
+    current = current->next.load(std::memory_order_relaxed);
+    goto start;
+  }
+
+  range.min.store(min);
+  range.max.store(max);
+} // local::range_reset()
+
+bool
+in_range(const Range &range, const void *const ptr) noexcept {
+  const std::uintptr_t search = reinterpret_cast<std::uintptr_t>(ptr);
+  return search >= range.min.load(std::memory_order_relaxed) &&
+         search < range.max.load(std::memory_order_relaxed);
+} // local::in_range()
+
 /*Pool*/
 Pool::Pool() noexcept
     : start{header::NodeType::SPECIAL, sp::node_size(0), sp::bucket_size(0),
             sp::buckets(0)}
-    , lock{} {
+    , lock{}
+    , range{}
+    , empty{nullptr}
+    , empty_length{0} {
+}
+
+/*Magazine*/
+Magazine::Magazine() noexcept
+    : length{0}
+    , entries{} {
 }
 
 /*PoolsRAII*/
 PoolsRAII::PoolsRAII() noexcept
     : buckets{}
     , total_alloc{0}
+    , range{}
+    , magazines{}
     , priv{nullptr}
     , next{nullptr}
     , reclaim(false)
+    , remote_free(nullptr)
     // free list {{{
-    , free_lock()
     , free_stack()
     , free_list(sp::node_size(0))
     , free_tree()
+    , free_size(nullptr)
+    , free_bytes(0)
 //}}}
 {
   free_list.next = &free_list;
@@ -361,17 +538,251 @@ Pools::init(global::State &state) noexcept {
 
 //=======SHARED===============================================
 namespace shared {
+static constexpr std::size_t SMALL_CLASSES =
+    (std::size_t(1) << SP_MALLOC_SMALL_CLASS_SHIFT) / 8;
+static constexpr std::size_t CLASS_GROUP =
+    std::size_t(1) << SP_MALLOC_CLASS_GROUP_SHIFT;
+
+static constexpr std::size_t
+class_index(std::size_t sz) noexcept {
+  if (sz <= (std::size_t(1) << SP_MALLOC_SMALL_CLASS_SHIFT)) {
+    return sz <= 8 ? 0 : ((sz + 7) >> 3) - 1;
+  }
+  // sz is in the range (2^group, 2^(group+1)]
+  const std::size_t group = std::size_t(63 - __builtin_clzl(sz - 1));
+  const std::size_t step_shift = group - SP_MALLOC_CLASS_GROUP_SHIFT;
+  const std::size_t offset = ((sz - 1) >> step_shift) - CLASS_GROUP;
+
+  return SMALL_CLASSES +
+         ((group - SP_MALLOC_SMALL_CLASS_SHIFT) << SP_MALLOC_CLASS_GROUP_SHIFT) +
+         offset;
+} // shared::class_index()
+
+static constexpr std::size_t
+class_size(std::size_t index) noexcept {
+  if (index < SMALL_CLASSES) {
+    return (index + 1) * 8;
+  }
+  index -= SMALL_CLASSES;
+  const std::size_t group =
+      SP_MALLOC_SMALL_CLASS_SHIFT + (index >> SP_MALLOC_CLASS_GROUP_SHIFT);
+  const std::size_t offset = index & (CLASS_GROUP - 1);
+
+  return (CLASS_GROUP + offset + 1) << (group - SP_MALLOC_CLASS_GROUP_SHIFT);
+} // shared::class_size()
+
+static constexpr std::size_t MAX_CLASS_SIZE =
+    std::size_t(1) << SP_MALLOC_MAX_CLASS_SHIFT;
+
+static_assert(class_size(SP_MALLOC_SIZE_CLASSES - 1) == MAX_CLASS_SIZE, "");
+static_assert(class_index(MAX_CLASS_SIZE) == SP_MALLOC_SIZE_CLASSES - 1, "");
+static_assert(class_size(class_index(4100)) == 5120, "");
+// every class is reachable, a length above the threshold is never pooled
+static_assert(class_index(SP_MALLOC_LARGE_THRESHOLD) ==
+                  SP_MALLOC_SIZE_CLASSES - 1,
+              "SP_MALLOC_MAX_CLASS_SHIFT does not match "
+              "SP_MALLOC_LARGE_THRESHOLD");
+
+static constexpr std::size_t
+extent_buckets(std::size_t node, std::size_t bucket) noexcept {
+  return node < bucket + header::SIZE ? 0 : (node - header::SIZE) / bucket;
+} // shared::extent_buckets()
+
+static constexpr std::size_t
+extent_waste(std::size_t node, std::size_t bucket) noexcept {
+  return node - header::SIZE - (extent_buckets(node, bucket) * bucket);
+} // shared::extent_waste()
+
+static constexpr bool
+extent_fits(std::size_t node, std::size_t bucket) noexcept {
+  return extent_buckets(node, bucket) > 0 &&
+         extent_buckets(node, bucket) <= header::Extent::max_buckets;
+} // shared::extent_fits()
+
+static constexpr std::size_t
+extent_size(std::size_t bucket) noexcept {
+  constexpr std::size_t page(SP_MALLOC_PAGE_SIZE);
+  if (bucket + header::SIZE > page * SP_MALLOC_EXTENT_MAX_PAGES) {
+    // a single bucket per extent
+    return ((bucket + header::SIZE + page - 1) / page) * page;
+  }
+
+  // choose the smallest extent where the tail waste is acceptable, otherwise
+  // the extent with the least waste relative to its size
+  std::size_t best(0);
+  for (std::size_t node(page); node <= page * SP_MALLOC_EXTENT_MAX_PAGES;
+       node += page) {
+    if (extent_fits(node, bucket)) {
+      const std::size_t waste = extent_waste(node, bucket);
+      if ((waste << SP_MALLOC_EXTENT_WASTE_SHIFT) <= node) {
+        return node;
+      }
+      // waste/node < best_waste/best
+      if (best == 0 || waste * best < extent_waste(best, bucket) * node) {
+        best = node;
+      }
+    }
+  }
+  return best;
+} // shared::extent_size()
+
+static constexpr SizeClass
+make_class(std::size_t index) noexcept {
+  return SizeClass{class_size(index), extent_size(class_size(index)),
+                   extent_buckets(extent_size(class_size(index)),
+                                  class_size(index)),
+                   util::reciprocal(class_size(index))};
+} // shared::make_class()
+
+template <std::size_t N, std::size_t... I>
+static constexpr std::array<SizeClass, N>
+make_classes(std::index_sequence<I...>) noexcept {
+  return std::array<SizeClass, N>{{make_class(I)...}};
+} // shared::make_classes()
+
+template <std::size_t N, std::size_t... I>
+static constexpr std::array<std::uint8_t, N>
+make_lookup(std::index_sequence<I...>) noexcept {
+  return std::array<std::uint8_t, N>{{std::uint8_t(class_index(I << 3))...}};
+} // shared::make_lookup()
+
+static constexpr std::array<SizeClass, SP_MALLOC_SIZE_CLASSES> size_classes =
+    make_classes<SP_MALLOC_SIZE_CLASSES>(
+        std::make_index_sequence<SP_MALLOC_SIZE_CLASSES>{});
+
+// Lookup table of the class index for sizes up to CLASS_LOOKUP_MAX, indexed
+// by the size in 8 byte steps.
+#define SP_MALLOC_CLASS_LOOKUP_MAX std::size_t(1024)
+static constexpr std::size_t CLASS_LOOKUP_LENGTH =
+    (SP_MALLOC_CLASS_LOOKUP_MAX >> 3) + 1;
+static constexpr std::array<std::uint8_t, CLASS_LOOKUP_LENGTH> class_lookup =
+    make_lookup<CLASS_LOOKUP_LENGTH>(
+        std::make_index_sequence<CLASS_LOOKUP_LENGTH>{});
+
+static constexpr std::size_t
+class_shift(std::size_t index) noexcept {
+  const std::size_t shift = std::size_t(__builtin_ctzl(class_size(index)));
+  return shift < SP_MALLOC_PAGE_SHIFT ? shift : SP_MALLOC_PAGE_SHIFT;
+} // shared::class_shift()
+
+static constexpr std::size_t
+class_shift_limit(std::size_t shift) noexcept {
+  std::size_t result(0);
+  for (std::size_t i(0); i < SP_MALLOC_SIZE_CLASSES; ++i) {
+    if (class_shift(i) <= shift) {
+      result = i + 1;
+    }
+  }
+  return result;
+} // shared::class_shift_limit()
+
+template <std::size_t N, std::size_t... I>
+static constexpr std::array<std::uint8_t, N>
+make_shifts(std::index_sequence<I...>) noexcept {
+  return std::array<std::uint8_t, N>{{std::uint8_t(class_shift(I))...}};
+} // shared::make_shifts()
+
+template <std::size_t N, std::size_t... I>
+static constexpr std::array<std::uint8_t, N>
+make_shift_limits(std::index_sequence<I...>) noexcept {
+  return std::array<std::uint8_t, N>{{std::uint8_t(class_shift_limit(I))...}};
+} // shared::make_shift_limits()
+
+static constexpr std::array<std::uint8_t, SP_MALLOC_SIZE_CLASSES> class_shifts =
+    make_shifts<SP_MALLOC_SIZE_CLASSES>(
+        std::make_index_sequence<SP_MALLOC_SIZE_CLASSES>{});
+
+static constexpr std::size_t SHIFT_LIMITS_LENGTH = SP_MALLOC_PAGE_SHIFT + 1;
+static constexpr std::array<std::uint8_t, SHIFT_LIMITS_LENGTH>
+    class_shift_limits = make_shift_limits<SHIFT_LIMITS_LENGTH>(
+        std::make_index_sequence<SHIFT_LIMITS_LENGTH>{});
+
+static_assert((std::size_t(1) << SP_MALLOC_PAGE_SHIFT) == SP_MALLOC_PAGE_SIZE,
+              "");
+static_assert(class_shift_limits[SP_MALLOC_PAGE_SHIFT] ==
+                  SP_MALLOC_SIZE_CLASSES,
+              "");
+// 8 byte aligned pointers can only be owned by classes of odd multiples of 8
+static_assert(class_shift_limits[3] < SP_MALLOC_SIZE_CLASSES, "");
+
+template <std::size_t I>
+struct ValidClasses {
+  static constexpr bool value =
+      size_classes[I - 1].node_size >= header::SIZE &&
+      size_classes[I - 1].buckets > 0 &&
+      size_classes[I - 1].buckets <= header::Extent::max_buckets &&
+      size_classes[I - 1].buckets ==
+          extent_buckets(size_classes[I - 1].node_size,
+                         size_classes[I - 1].bucket_size) &&
+      ValidClasses<I - 1>::value;
+};
+
+template <>
+struct ValidClasses<0> {
+  static constexpr bool value = true;
+};
+
+static_assert(ValidClasses<SP_MALLOC_SIZE_CLASSES>::value,
+              "extent geometry exceeds Extent::max_buckets");
+static_assert(size_classes[0].node_size == SP_MALLOC_PAGE_SIZE, "");
+static_assert(SP_MALLOC_MAGAZINE_CLASSES <= SP_MALLOC_SIZE_CLASSES, "");
+static_assert(SP_MALLOC_SIZE_CLASSES <= 256, "Node::size_class is 8 bits");
+static_assert(SP_MALLOC_MAGAZINE_BATCH <= SP_MALLOC_MAGAZINE_SIZE, "");
+
+std::size_t
+size_class_index(std::size_t sz) noexcept {
+  if (sz <= SP_MALLOC_CLASS_LOOKUP_MAX) {
+    return class_lookup[(sz + 7) >> 3];
+  }
+  if (sz > MAX_CLASS_SIZE) {
+    return SP_MALLOC_SIZE_CLASSES;
+  }
+  return class_index(sz);
+} // shared::size_class_index()
+
+const SizeClass &
+size_class(std::size_t index) noexcept {
+  assert(index < SP_MALLOC_SIZE_CLASSES);
+  return size_classes[index];
+} // shared::size_class()
+
 sp::bucket_size
 bucket_size_for(std::size_t sz) noexcept {
-  return sp::bucket_size{util::round_even(sz)};
+  const std::size_t index = size_class_index(sz);
+  if (index == SP_MALLOC_SIZE_CLASSES) {
+    return sp::bucket_size{0};
+  }
+  return sp::bucket_size{size_classes[index].bucket_size};
 }
 
 std::size_t
 pool_index(sp::bucket_size sz) noexcept {
   assert(sz % 8 == 0);
-  return util::trailing_zeros(std::size_t(sz)) - std::size_t(3);
+  const std::size_t result = size_class_index(std::size_t(sz));
+  assert(result < SP_MALLOC_SIZE_CLASSES);
+  assert(size_classes[result].bucket_size == std::size_t(sz));
+  return result;
 } // ::pool_index()
 
+sp::bucket_size
+pool_bucket_size(std::size_t index) noexcept {
+  return sp::bucket_size{size_class(index).bucket_size};
+} // ::pool_bucket_size()
+
+std::size_t
+pool_shift(std::size_t index) noexcept {
+  assert(index < SP_MALLOC_SIZE_CLASSES);
+  return class_shifts[index];
+} // shared::pool_shift()
+
+std::size_t
+pool_shift_limit(std::size_t shift) noexcept {
+  if (shift >= SP_MALLOC_PAGE_SHIFT) {
+    return SP_MALLOC_SIZE_CLASSES;
+  }
+  return class_shift_limits[shift];
+} // shared::pool_shift_limit()
+
 local::Pool &
 pool_for(local::PoolsRAII &pools, sp::bucket_size sz) noexcept {
   const std::size_t index = pool_index(sz);
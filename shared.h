@@ -11,8 +11,65 @@
 #include <mutex>
 
 #define SP_MALLOC_PAGE_SIZE std::size_t(4 * 1024)
+#define SP_MALLOC_PAGE_SHIFT std::size_t(12)
 #define SP_MALLOC_CACHE_LINE_SIZE 64
+// Address space reserved up front by global::State, committed on demand
+#define SP_MALLOC_ARENA_RESERVE (std::size_t(32) * 1024 * 1024 * 1024)
+// Number of independent global::State arenas threads are spread over
+#define SP_MALLOC_ARENAS std::size_t(8)
+// Number of address space reservations an arena remembers, freed spans are
+// routed back to the arena whose reservation contains them, see
+// global::dealloc()
+#define SP_MALLOC_ARENA_RESERVATIONS std::size_t(16)
+// Free ranges idle for longer than this are returned to the OS, see
+// global::purge()
+#define SP_MALLOC_PURGE_DECAY_MS std::uint64_t(1000)
 #define SP_ALLOC_INITIAL_ALLOC sp::node_size(SP_MALLOC_PAGE_SIZE)
+// Allocations larger than this bypass the pools and are mapped directly, see
+// large.h
+#ifndef SP_MALLOC_LARGE_THRESHOLD
+#define SP_MALLOC_LARGE_THRESHOLD (std::size_t(256) * 1024)
+#endif
+// A realloc() to a size class at least this many times smaller than the
+// current bucket moves the allocation to the smaller class
+#define SP_MALLOC_SHRINK_FACTOR std::size_t(4)
+// A thread local free list holding more than SP_MALLOC_FREE_HIGH_PERCENT of
+// the memory the thread has in use, and at least SP_MALLOC_FREE_HIGH_MIN, is
+// trimmed down to half of that by returning ranges to global, see local::trim()
+#define SP_MALLOC_FREE_HIGH_MIN (std::size_t(4) * 1024 * 1024)
+#define SP_MALLOC_FREE_HIGH_PERCENT std::size_t(50)
+
+// Size classes are spaced 8 bytes apart up to 64 bytes, after that there are
+// four classes for each doubling [80,96,112,128],[160,192,224,256],... up to
+// the largest class of 2^SP_MALLOC_MAX_CLASS_SHIFT bytes. Larger lengths are
+// served by large::alloc() so the largest class is the one holding
+// SP_MALLOC_LARGE_THRESHOLD.
+#define SP_MALLOC_SMALL_CLASS_SHIFT std::size_t(6)
+#define SP_MALLOC_CLASS_GROUP_SHIFT std::size_t(2)
+#define SP_MALLOC_MAX_CLASS_SHIFT std::size_t(18)
+#define SP_MALLOC_SIZE_CLASSES                                                 \
+  (((std::size_t(1) << SP_MALLOC_SMALL_CLASS_SHIFT) / 8) +                     \
+   ((SP_MALLOC_MAX_CLASS_SHIFT - SP_MALLOC_SMALL_CLASS_SHIFT)                  \
+    << SP_MALLOC_CLASS_GROUP_SHIFT))
+
+// Extents of a size class are at most SP_MALLOC_EXTENT_MAX_PAGES pages, the
+// smallest extent with an unused tail of at most 1/2^SP_MALLOC_EXTENT_WASTE_SHIFT
+// of the extent is used.
+#define SP_MALLOC_EXTENT_MAX_PAGES std::size_t(8)
+#define SP_MALLOC_EXTENT_WASTE_SHIFT std::size_t(3)
+
+// Up to SP_MALLOC_EMPTY_EXTENTS empty extents, and at most
+// SP_MALLOC_EMPTY_EXTENT_BYTES, are kept per size class by the owning thread
+// and reused before a new extent is allocated from the free list.
+#define SP_MALLOC_EMPTY_EXTENTS std::size_t(2)
+#define SP_MALLOC_EMPTY_EXTENT_BYTES (std::size_t(64) * 1024)
+
+// The first SP_MALLOC_MAGAZINE_CLASSES size classes (up to 1024 bytes) are
+// cached in a thread local magazine of SP_MALLOC_MAGAZINE_SIZE buckets, which
+// is refilled and flushed SP_MALLOC_MAGAZINE_BATCH buckets at a time.
+#define SP_MALLOC_MAGAZINE_CLASSES std::size_t(24)
+#define SP_MALLOC_MAGAZINE_SIZE std::size_t(32)
+#define SP_MALLOC_MAGAZINE_BATCH std::size_t(16)
 
 #define SP_TYPED_NUMERIC
 #ifdef SP_TYPED_NUMERIC
@@ -24,6 +81,7 @@ SIZE_TYPE(bucket_size);
 SIZE_TYPE(node_size);
 SIZE_TYPE(buckets);
 SIZE_TYPE(index);
+SIZE_TYPE(pages);
 
 } // namespace sp
 
@@ -51,34 +109,79 @@ using bucket_size = std::size_t;
 using node_size = std::size_t;
 using buckets = std::size_t;
 using index = std::size_t;
+using pages = std::size_t;
 } // namespace sp
 
 #endif
 
+//========LOCAL==============================================
+namespace local {
+struct PoolsRAII;
+} // namespace local
+
+//========SHARED=============================================
+namespace shared {
+/* The alignment shift of the buckets in the size class with @index, that is
+ * the trailing zeros of the bucket size capped at SP_MALLOC_PAGE_SHIFT.
+ */
+std::size_t pool_shift(std::size_t index) noexcept;
+
+/* Size classes with an index >= the result all have a pool_shift() larger
+ * than @shift.
+ */
+std::size_t pool_shift_limit(std::size_t shift) noexcept;
+} // namespace shared
+
 //========HEADER=============================================
 namespace header {
 
 /*Free*/
+// A free span of whole pages, the header is stored in its first page
 struct alignas(SP_MALLOC_CACHE_LINE_SIZE) Free { //
-  sp::ReadWriteLock next_lock;
-  sp::node_size size;
-  std::atomic<Free *> next;
+  sp::pages pages;
+  // util::monotonic_ms() of when the range was last returned
+  std::uint64_t freed_at;
+  // tree ordered by address {{{
+  Free *address_left;
+  Free *address_right;
+  // }}}
+  // tree ordered by [purged, size, address] {{{
+  Free *size_left;
+  Free *size_right;
+  // }}}
+  std::uint8_t address_height;
+  std::uint8_t size_height;
+  // the pages after the first has been returned to the OS
+  bool purged;
 
-  Free(sp::node_size, Free *) noexcept;
-  explicit Free(sp::node_size) noexcept;
+  explicit Free(sp::pages) noexcept;
 };
 
+/* The number of the first page of @free, its address >> SP_MALLOC_PAGE_SHIFT.
+ */
+std::uintptr_t
+page_number(const Free *) noexcept;
+
+/* @return            the length of @free in bytes
+ */
+std::size_t
+free_length(const Free *) noexcept;
+
 bool
 is_consecutive(const Free *const head, const Free *const tail) noexcept;
 
 void
-coalesce(Free *head, Free *tail, Free *const next) noexcept;
+coalesce(Free *head, Free *tail) noexcept;
 
+/* @param[in] head    page aligned start of the span
+ */
 Free *
-init_free(void *const head, sp::node_size length) noexcept;
+init_free(void *const head, sp::pages length) noexcept;
 
+/* Split off @length pages from the end of @free.
+ */
 Free *
-reduce(Free *, sp::node_size) noexcept;
+reduce(Free *, sp::pages) noexcept;
 
 Free *
 free(void *const start) noexcept;
@@ -89,10 +192,16 @@ struct LocalFree {
   LocalFree *next;
   LocalFree *priv;
   //}}}
-  // tree{{{
+  // tree by address{{{
   LocalFree *left;
   LocalFree *right;
   //}}}
+  // tree by size{{{
+  LocalFree *size_left;
+  LocalFree *size_right;
+  //}}}
+  std::uint8_t height;
+  std::uint8_t size_height;
   sp::node_size size;
 
   LocalFree() noexcept;
@@ -111,6 +220,14 @@ init_local_free(void *head, sp::node_size, LocalFree *next) noexcept;
 bool
 is_consecutive(LocalFree *, LocalFree *) noexcept;
 
+/*RemoteFree*/
+// Overlaid on a bucket freed by a thread not owning it
+struct RemoteFree {
+  RemoteFree *next;
+
+  RemoteFree() noexcept;
+};
+
 /*Extent*/
 struct Node;
 
@@ -138,7 +255,9 @@ enum class NodeType : uint8_t { //
 struct /*alignas(SP_MALLOC_CACHE_LINE_SIZE)*/ Node { //
   static constexpr std::size_t ALIGNMENT = 64;
   // TODO padding based on arch(for pointer size)
-  uint8_t pad0[16];
+  // the pools the extent is linked into, only present in NodeType::HEAD
+  local::PoolsRAII *owner;
+  uint8_t pad0[8];
   // next node
   std::atomic<Node *> next;
   // size of bucket
@@ -157,15 +276,30 @@ struct /*alignas(SP_MALLOC_CACHE_LINE_SIZE)*/ Node { //
   // };
   const NodeType type;
   // TODO const std::size_t offset; for where the first bucket start
-  uint8_t pad1[15];
+  // the size class index of bucket_size, see shared::pool_index()
+  uint8_t size_class;
+  uint8_t pad1[2];
+  // see util::reciprocal(), used for non power of two bucket_size
+  const std::uint32_t bucket_reciprocal;
+  uint8_t pad2[8];
 
   Node(NodeType, sp::node_size, sp::bucket_size, sp::buckets) noexcept;
 };
 Node *
-init_extent(void *const, sp::node_size, sp::bucket_size) noexcept;
+init_extent(void *const, sp::node_size, sp::bucket_size,
+            local::PoolsRAII *) noexcept;
 Node *
 node(void *const start) noexcept;
 
+/* Extents are naturally aligned to their size rounded up to a power of two,
+ * meaning that the Node header of any pointer inside an extent is found by
+ * masking the pointer with the alignment.
+ */
+std::size_t extent_alignment(sp::node_size) noexcept;
+
+Node *
+node(void *const ptr, std::size_t alignment) noexcept;
+
 static constexpr std::size_t SIZE(sizeof(header::Node) +
                                   sizeof(header::Extent));
 
@@ -174,21 +308,54 @@ node_data_size(Node *) noexcept;
 std::uintptr_t
 node_data_start(Node *) noexcept;
 
+/* Index of the bucket starting @offset bytes into the data area of @node.
+ * Nothing is returned if @offset is not the start of a bucket.
+ */
+sp::maybe<sp::index>
+bucket_index(const Node *, std::size_t offset) noexcept;
+
+void *
+bucket_at(Node *, sp::index) noexcept;
+
 } // namespace header
 
 //=======GLOBAL===============================================
 namespace global {
+struct Reservation {
+  std::uintptr_t start;
+  std::uintptr_t end;
+};
+
 struct State {
-  // brk{{{
-  std::mutex brk_lock;
-  void *brk_position; // not used for now
-  std::size_t brk_alloc;
+  // arena{{{
+  // [arena_position, arena_end) is reserved but not yet committed
+  std::mutex arena_lock;
+  std::uintptr_t arena_position;
+  std::uintptr_t arena_end;
+  // every reservation made by the arena, appended during the arena_lock and
+  // published to lock free readers by reservations_length
+  Reservation reservations[SP_MALLOC_ARENA_RESERVATIONS];
+  std::atomic<std::size_t> reservations_length;
+  // total committed
+  std::size_t arena_alloc;
+  // NUMA node the reservations are bound to, see numa::bind()
+  std::size_t node;
   // }}}
 
   // free{{{
-  header::Free free;
+  // protects both trees of free ranges
+  std::mutex free_lock;
+  header::Free *free_address;
+  header::Free *free_size;
+  // util::monotonic_ms() when the next purge() is due
+  std::atomic<std::uint64_t> purge_at;
 // }}}
 
+  // next arena in the ring which free ranges are stolen from when this arena
+  // is exhausted, only siblings on the same node are stolen from, see
+  // global::link()
+  State *sibling;
+
 // test{{{
 #ifdef SP_TEST
   bool skip_alloc;
@@ -201,10 +368,43 @@ struct State {
 
 //=======LOCAL===============================================
 namespace local {
+/*Range*/
+// Conservative [min, max) address bounds of a set of extents, read without
+// any lock to skip walking extents which can not contain a pointer.
+struct Range { //
+  std::atomic<std::uintptr_t> min;
+  std::atomic<std::uintptr_t> max;
+
+  Range() noexcept;
+
+  Range(const Range &) = delete;
+  Range(Range &&) = delete;
+}; // struct Range
+
+/* Grow @range to include the extent @node. Must be done before @node is
+ * published to other threads.
+ */
+void
+range_extend(Range &range, const header::Node *node) noexcept;
+
+/* Set @range to the bounds of the extents in the list starting at @start.
+ * Ranges only shrink during an exclusive lock of the list.
+ */
+void
+range_reset(Range &range, const header::Node *start) noexcept;
+
+bool
+in_range(const Range &range, const void *ptr) noexcept;
+
 /*Pool*/
 struct Pool { //
   header::Node start;
   sp::ReadWriteLock lock;
+  // bounds of the extents linked after start
+  Range range;
+  // empty extents linked by Node::next, only accessed by the owning thread
+  header::Node *empty;
+  std::size_t empty_length;
 
   Pool() noexcept;
 
@@ -218,14 +418,26 @@ struct Pool { //
 
 }; // struct Pool
 
+/*Magazine*/
+struct Magazine { //
+  std::size_t length;
+  void *entries[SP_MALLOC_MAGAZINE_SIZE];
+
+  Magazine() noexcept;
+}; // struct Magazine
+
 /*Pools*/
 struct PoolsRAII { //
   // TODO restructure for tighter alignment
-  static constexpr std::size_t BUCKETS =
-      (sizeof(std::size_t) * 8) - 3; // TODO what is this?
+  static constexpr std::size_t BUCKETS = SP_MALLOC_SIZE_CLASSES;
   //
   std::array<Pool, BUCKETS> buckets;
   std::atomic<std::size_t> total_alloc;
+  // bounds of all extents ever linked into buckets, only grows
+  Range range;
+
+  // only accessed by the owning thread, see magazine.h
+  std::array<Magazine, SP_MALLOC_MAGAZINE_CLASSES> magazines;
 
   // global list of pools {
   PoolsRAII *priv;
@@ -236,12 +448,20 @@ struct PoolsRAII { //
   std::atomic<bool> reclaim;
   //}
 
+  // remote free {{{
+  // buckets freed by other threads, drained by the owning thread
+  std::atomic<header::RemoteFree *> remote_free;
+  // }}}
+
   // free list{{{
   // stack {{{
-  sp::ReadWriteLock free_lock;
+  // pushed lock free by any thread, drained by the owning thread
   std::atomic<header::LocalFree *> free_stack;
   header::LocalFree free_list;
   header::LocalFree free_tree;
+  header::LocalFree *free_size;
+  // bytes in free_list, only touched by the owning thread
+  std::size_t free_bytes;
   // }}}
 
   PoolsRAII() noexcept;
@@ -282,19 +502,31 @@ template <typename Res, typename Arg>
 sp::maybe<Res>
 pools_find(PoolsRAII &pools, void *const search, PFind<Res, Arg> f,
            Arg &arg) noexcept {
-  std::uintptr_t rawSearch = reinterpret_cast<std::uintptr_t>(search);
-  std::size_t trail0 = util::trailing_zeros(rawSearch);
-
-  const std::size_t offset = 1 << trail0;
-  if (offset < 8) {
+  const std::uintptr_t rawSearch = reinterpret_cast<std::uintptr_t>(search);
+  if (rawSearch % 8 != 0) {
     // runtime fault, the minimum alignment is 8
     assert(false);
     return {};
   }
-  // TODO
-  // std::size_t max = offset >= sizeof(header::Node) ? Pools::BUCKETS : tz + 1;
-  const std::size_t max = Pools::BUCKETS;
+  if (!in_range(pools.range, search)) {
+    return {};
+  }
+
+  // Extents are at least page aligned and their buckets start at header::SIZE,
+  // so the offset of a bucket within its page is a multiple of the bucket size
+  // modulo the page size. Pools whose buckets are more aligned than the offset
+  // of @search can not own it.
+  const std::uintptr_t offset =
+      (rawSearch - header::SIZE) & (SP_MALLOC_PAGE_SIZE - 1);
+  const std::size_t shift =
+      offset ? util::trailing_zeros(offset) : SP_MALLOC_PAGE_SHIFT;
+
+  const std::size_t max = shared::pool_shift_limit(shift);
+  assert(max <= Pools::BUCKETS);
   for (std::size_t i(0); i < max; ++i) {
+    if (shared::pool_shift(i) > shift) {
+      continue;
+    }
     auto result = f(pools[i], search, arg);
     if (result) {
       return result;
@@ -325,10 +557,37 @@ enum class FreeCode { FREED, FREED_RECLAIM, NOT_FOUND, DOUBLE_FREE };
   } while (0)
 #endif
 
-sp::bucket_size bucket_size_for(std::size_t) noexcept;
+/* Geometry of a size class, the table of all classes is generated at compile
+ * time.
+ */
+struct SizeClass {
+  std::size_t bucket_size;
+  // size of the extents allocated for the class
+  std::size_t node_size;
+  // buckets in each extent
+  std::size_t buckets;
+  // see util::reciprocal()
+  std::uint32_t reciprocal;
+};
+
+/* The index of the size class @length is rounded up to,
+ * local::PoolsRAII::BUCKETS if @length is larger than the largest size class.
+ */
+std::size_t size_class_index(std::size_t length) noexcept;
+
+const SizeClass &size_class(std::size_t index) noexcept;
+
+/* The size class @length is rounded up to, 0 if @length is larger than the
+ * largest size class.
+ */
+sp::bucket_size bucket_size_for(std::size_t length) noexcept;
 
 std::size_t pool_index(sp::bucket_size) noexcept;
 
+/* The bucket size of the size class with @index, the inverse of pool_index().
+ */
+sp::bucket_size pool_bucket_size(std::size_t index) noexcept;
+
 local::Pool &
 pool_for(local::PoolsRAII &, sp::bucket_size) noexcept;
 
@@ -1,5 +1,7 @@
 #include "free.h"
 #include "global.h"
+#include "magazine.h"
+#include "pagemap.h"
 #include "stuff.h"
 #ifdef SP_TEST
 #include "alloc_debug.h"
@@ -9,7 +11,11 @@
 #include <cassert>
 #include <cstring>
 
-#define SP_MALLOC_POOL_SIZE sp::node_size(SP_MALLOC_PAGE_SIZE * 2)
+// PoolsRAII rounded up to whole pages
+#define SP_MALLOC_POOL_SIZE                                                    \
+  sp::node_size(((sizeof(local::PoolsRAII) + SP_MALLOC_PAGE_SIZE - 1) /        \
+                 SP_MALLOC_PAGE_SIZE) *                                        \
+                SP_MALLOC_PAGE_SIZE)
 
 //===========================================================
 struct asd {
@@ -83,8 +89,8 @@ cons(header::LocalFree *first, header::LocalFree *second) noexcept {
   if (!second)
     return first;
 
-cont:
   header::LocalFree *last = first;
+cont:
   if (last->next) {
     last = last->next;
     goto cont;
@@ -99,18 +105,22 @@ recycle_pool(global::State &global, asd &a, sp::SharedLock &lock,
   if (unlink_pool(a, lock, subject)) {
     // lock is not held here
     assert(!lock);
-    // 1. TL free list
-    header::LocalFree *reclaim = subject->free_list.next;
-    subject->free_list.next = nullptr;
-    // 2. Concurrent free stack
+    // 1. TL free list, a ring around the free_list sentinel
+    header::LocalFree *reclaim = nullptr;
     {
-      header::LocalFree *stack = subject->free_stack.load();
-    stack_retry:
-      if (!subject->free_stack.compare_exchange_weak(stack, nullptr))
-        goto stack_retry;
-
-      reclaim = cons(reclaim, stack);
+      header::LocalFree *const sentinel = &subject->free_list;
+      if (sentinel->next != sentinel) {
+        reclaim = sentinel->next;
+        sentinel->priv->next = nullptr;
+      }
+      sentinel->next = sentinel;
+      sentinel->priv = sentinel;
+      subject->free_tree.next = nullptr;
+      subject->free_size = nullptr;
+      subject->free_bytes = 0;
     }
+    // 2. Concurrent free stack
+    reclaim = cons(reclaim, subject->free_stack.exchange(nullptr));
 
     // 3. the pool itself
     void *const target = reinterpret_cast<void *>(subject);
@@ -156,6 +166,18 @@ enqueue(asd &a, sp::SharedLock &lock, local::PoolsRAII *subject) noexcept {
   return false;
 }
 
+/* The owner recorded in the extent containing @ptr, nullptr when the page map
+ * does not know about @ptr.
+ */
+static local::PoolsRAII *
+owner_of(void *const ptr) noexcept {
+  auto entry = pagemap::lookup(ptr);
+  if (entry) {
+    return entry.get().owner;
+  }
+  return nullptr;
+}
+
 //=======GLOBAL===============================================
 namespace global {
 
@@ -165,7 +187,25 @@ free(global::State &global, local::Pools &tl, void *const ptr) noexcept {
   using shared::FreeCode;
   sp::SharedLock shared_guard{internal_a.lock};
   if (shared_guard) {
-    local::PoolsRAII *current = internal_a.head.load(std::memory_order_acquire);
+    // The shared lock keeps the owner alive, a Pool is only recycled after it
+    // has been unlinked from internal_a during an exclusive lock.
+    auto entry = pagemap::lookup(ptr);
+    local::PoolsRAII *current = entry ? entry.get().owner : nullptr;
+    if (current && current != tl.pools) {
+      // hand the bucket over to the owning thread without touching its locks
+      const auto result = shared::remote_free(*current, entry.get().node, ptr);
+      if (result != FreeCode::NOT_FOUND) {
+        return result;
+      }
+      // the owner has exited, free directly in the orphaned pool
+    }
+
+    if (!current) {
+      if (pagemap::is_complete()) {
+        return FreeCode::NOT_FOUND;
+      }
+      current = internal_a.head.load(std::memory_order_acquire);
+    }
   next:
     if (current) {
       shared::State state(global, *current, tl);
@@ -184,6 +224,9 @@ free(global::State &global, local::Pools &tl, void *const ptr) noexcept {
 
         return result;
       }
+      if (pagemap::is_complete()) {
+        return FreeCode::NOT_FOUND;
+      }
       current = current->next;
       goto next;
     }
@@ -198,7 +241,15 @@ sp::maybe<sp::bucket_size>
 usable_size(void *const ptr) noexcept {
   sp::SharedLock shared_guard{internal_a.lock};
   if (shared_guard) {
-    local::PoolsRAII *current = internal_a.head.load(std::memory_order_acquire);
+    local::PoolsRAII *current = owner_of(ptr);
+    if (current) {
+      return shared::usable_size(*current, ptr);
+    }
+    if (pagemap::is_complete()) {
+      return {};
+    }
+
+    current = internal_a.head.load(std::memory_order_acquire);
   next:
     if (current) {
       auto result = shared::usable_size(*current, ptr);
@@ -217,7 +268,13 @@ realloc(global::State &global, local::PoolsRAII &tl, void *const ptr,
         std::size_t length) noexcept {
   sp::SharedLock shared_guard{internal_a.lock};
   if (shared_guard) {
-    local::PoolsRAII *current = internal_a.head.load(std::memory_order_acquire);
+    local::PoolsRAII *current = owner_of(ptr);
+    if (!current) {
+      if (pagemap::is_complete()) {
+        return {};
+      }
+      current = internal_a.head.load(std::memory_order_acquire);
+    }
   next:
     if (current) {
       auto code = shared::FreeCode::FREED;
@@ -229,7 +286,7 @@ realloc(global::State &global, local::PoolsRAII &tl, void *const ptr,
           assert(false);
         }
       }
-      if (result) {
+      if (result || pagemap::is_complete()) {
         return result;
       }
       current = current->next;
@@ -254,7 +311,8 @@ acquire_pool(global::State &global) noexcept {
   static_assert(sizeof(PoolType) <= length, "");
 
   PoolType *result = nullptr;
-  void *const memory = global::alloc(global, sp::node_size(length));
+  void *const memory =
+      global::alloc(global, sp::pages(length >> SP_MALLOC_PAGE_SHIFT));
   if (memory) {
     result = new (memory) PoolType;
 
@@ -274,6 +332,11 @@ acquire_pool(global::State &global) noexcept {
 void
 release_pool(global::State &global, local::PoolsRAII *pool) noexcept {
   assert(pool->reclaim.load() == false);
+  // the cached buckets are not in use and should not keep the pool alive
+  magazine::flush(global, *pool);
+  // after this other threads free our memory directly
+  shared::drain_remote_free(global, *pool, true);
+  shared::flush_empty_extents(*pool);
   pool->reclaim.store(true);
   std::size_t allocs = pool->total_alloc.load();
   if (allocs == 0) {
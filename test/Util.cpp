@@ -127,12 +127,21 @@ assert_no_gaps(Points &free) {
 //==================================================================================================
 std::size_t
 roundAlloc(std::size_t sz) {
-  for (std::size_t i(8); i < ~std::size_t(0); i <<= 1) {
+  // 8 byte steps up to 64 then 4 size classes per doubling
+  for (std::size_t i(8); i <= 64; i += 8) {
     if (sz <= i) {
-      // printf("sz(%zu)%zu\n", sz, i);
       return i;
     }
   }
+  for (std::size_t i(64); i < (~std::size_t(0) >> 1); i <<= 1) {
+    const std::size_t step = i / 4;
+    for (std::size_t c(i + step); c <= i * 2; c += step) {
+      if (sz <= c) {
+        // printf("sz(%zu)%zu\n", sz, c);
+        return c;
+      }
+    }
+  }
   assert(false);
   return 0;
 }
@@ -8,7 +8,9 @@
 #include <alloc_debug.h>
 #include <forward_list>
 #include <free.h>
+#include <magazine.h>
 #include <global_debug.h>
+#include <pagemap.h>
 #include <shared.h>
 #include <string>
 #include <functional>
@@ -151,6 +153,444 @@ TEST(AllocTest, test_local_alloc_local_free_list) {
   }
   ::free(mptr);
 }
+//==================================================================================================
+TEST(AllocTest, test_pagemap_lookup) {
+  local::PoolsRAII pool;
+  const std::size_t arena = SP_MALLOC_PAGE_SIZE * 4;
+  // extents are naturally aligned to their size
+  uint8_t *const mptr = (uint8_t *)aligned_alloc(arena, arena);
+  const sp::node_size half(arena / 2);
+
+  header::Node *const first =
+      header::init_extent(mptr, half, sp::bucket_size(8), &pool);
+  header::Node *const second =
+      header::init_extent(mptr + arena / 2, half, sp::bucket_size(16), &pool);
+
+  for (std::size_t i = 0; i < arena; i += 8) {
+    auto entry = pagemap::lookup(mptr + i);
+    ASSERT_TRUE(bool(entry));
+    ASSERT_EQ(&pool, entry.get().owner);
+    ASSERT_EQ(i < arena / 2 ? first : second, entry.get().node);
+  }
+  ASSERT_EQ(&pool, first->owner);
+  ASSERT_EQ(shared::size_class_index(8), std::size_t(first->size_class));
+  ASSERT_EQ(shared::size_class_index(16), std::size_t(second->size_class));
+
+  pagemap::remove(first);
+  ASSERT_FALSE(bool(pagemap::lookup(mptr)));
+  ASSERT_EQ(second, pagemap::lookup(mptr + arena / 2).get().node);
+
+  pagemap::remove(second);
+  ASSERT_FALSE(bool(pagemap::lookup(mptr + arena - 1)));
+  ::free(mptr);
+}
+
+//==================================================================================================
+TEST(AllocTest, test_magazine) {
+  using shared::FreeCode;
+  global::State global;
+  local::PoolsRAII pool;
+  const std::size_t arena = SP_MALLOC_PAGE_SIZE * 16;
+  global.skip_alloc = true;
+  uint8_t *mptr = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, arena);
+  LocalFree *const free = header::init_local_free(mptr, sp::node_size(arena));
+  local::dealloc(pool, free, free);
+  const std::size_t allocSz = 32;
+  const local::Magazine &magazine =
+      pool.magazines[shared::size_class_index(allocSz)];
+
+  void *const first = magazine::alloc(global, pool, allocSz);
+  ASSERT_FALSE(first == nullptr);
+  ASSERT_EQ(SP_MALLOC_MAGAZINE_BATCH - 1, magazine.length);
+  ASSERT_EQ(std::size_t(1), debug::alloc_count_alloc(pool, allocSz));
+
+  ASSERT_EQ(FreeCode::FREED, magazine::free(global, pool, first));
+  ASSERT_EQ(FreeCode::DOUBLE_FREE, magazine::free(global, pool, first));
+  ASSERT_EQ(std::size_t(0), debug::alloc_count_alloc(pool, allocSz));
+  // LIFO
+  ASSERT_EQ(first, magazine::alloc(global, pool, allocSz));
+
+  std::vector<void *> ptrs{first};
+  for (std::size_t i = 0; i < SP_MALLOC_MAGAZINE_SIZE * 2; ++i) {
+    void *const ptr = magazine::alloc(global, pool, allocSz);
+    ASSERT_FALSE(ptr == nullptr);
+    ptrs.push_back(ptr);
+  }
+  ASSERT_EQ(ptrs.size(), debug::alloc_count_alloc(pool, allocSz));
+
+  std::size_t allocs = ptrs.size();
+  for (void *ptr : ptrs) {
+    ASSERT_EQ(FreeCode::FREED, magazine::free(global, pool, ptr));
+    ASSERT_TRUE(magazine.length <= SP_MALLOC_MAGAZINE_SIZE);
+    ASSERT_EQ(--allocs, debug::alloc_count_alloc(pool, allocSz));
+  }
+
+  magazine::flush(global, pool);
+  ASSERT_EQ(std::size_t(0), magazine.length);
+  ASSERT_EQ(std::size_t(0), debug::alloc_count_alloc(pool, allocSz));
+  // the now empty extent was recycled
+  ASSERT_TRUE(pool[shared::size_class_index(allocSz)].start.next == nullptr);
+  ::free(mptr);
+}
+
+//==================================================================================================
+TEST(AllocTest, test_remote_free) {
+  using shared::FreeCode;
+  global::State global;
+  local::PoolsRAII pool;
+  const std::size_t arena = SP_MALLOC_PAGE_SIZE * 16;
+  global.skip_alloc = true;
+  uint8_t *mptr = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, arena);
+  LocalFree *const free = header::init_local_free(mptr, sp::node_size(arena));
+  local::dealloc(pool, free, free);
+
+  void *const first = shared::alloc(global, pool, 64);
+  void *const second = shared::alloc(global, pool, 64);
+  ASSERT_FALSE(first == nullptr);
+  ASSERT_FALSE(second == nullptr);
+  header::Node *const node = pagemap::lookup(first).get().node;
+  ASSERT_EQ(node, pagemap::lookup(second).get().node);
+
+  ASSERT_EQ(FreeCode::FREED, shared::remote_free(pool, node, first));
+  // reserved until the owner drains the stack
+  ASSERT_EQ(std::size_t(2), debug::alloc_count_alloc(pool, 64));
+  ASSERT_FALSE(pool.remote_free.load() == nullptr);
+
+  shared::drain_remote_free(global, pool, false);
+  ASSERT_EQ(std::size_t(1), debug::alloc_count_alloc(pool, 64));
+  ASSERT_TRUE(pool.remote_free.load() == nullptr);
+  ASSERT_EQ(FreeCode::DOUBLE_FREE, shared::remote_free(pool, node, first));
+
+  // the next alloc drains the stack
+  ASSERT_EQ(FreeCode::FREED, shared::remote_free(pool, node, second));
+  void *const third = shared::alloc(global, pool, 64);
+  ASSERT_TRUE(pool.remote_free.load() == nullptr);
+  ASSERT_EQ(std::size_t(1), debug::alloc_count_alloc(pool, 64));
+
+  // a closed stack is freed directly by the caller
+  shared::drain_remote_free(global, pool, true);
+  ASSERT_EQ(FreeCode::NOT_FOUND, shared::remote_free(pool, node, third));
+  ASSERT_EQ(std::size_t(1), debug::alloc_count_alloc(pool, 64));
+  ::free(mptr);
+}
+
+//==================================================================================================
+TEST(AllocTest, test_pool_range) {
+  using shared::FreeCode;
+  global::State global;
+  local::PoolsRAII pool;
+  const std::size_t arena = SP_MALLOC_PAGE_SIZE * 16;
+  global.skip_alloc = true;
+  uint8_t *mptr = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, arena);
+  LocalFree *const free = header::init_local_free(mptr, sp::node_size(arena));
+  local::dealloc(pool, free, free);
+  local::Pool &bucket = pool[shared::size_class_index(64)];
+  ASSERT_FALSE(local::in_range(pool.range, mptr));
+  ASSERT_FALSE(local::in_range(bucket.range, mptr));
+
+  void *const ptr = shared::alloc(global, pool, 64);
+  ASSERT_FALSE(ptr == nullptr);
+  header::Node *const node = pagemap::lookup(ptr).get().node;
+  uint8_t *const node_end = (uint8_t *)node + std::size_t(node->node_size);
+  ASSERT_TRUE(local::in_range(pool.range, ptr));
+  ASSERT_TRUE(local::in_range(bucket.range, ptr));
+  ASSERT_TRUE(local::in_range(bucket.range, node));
+  ASSERT_FALSE(local::in_range(bucket.range, node_end));
+  ASSERT_FALSE(local::in_range(pool[shared::size_class_index(128)].range, ptr));
+
+  {
+    shared::State state{global, pool, pool};
+    ASSERT_EQ(FreeCode::FREED, shared::free(state, ptr));
+  }
+  // the Pool bounds shrink with the extent while the PoolsRAII bounds only grow
+  ASSERT_FALSE(local::in_range(bucket.range, ptr));
+  ASSERT_TRUE(local::in_range(pool.range, ptr));
+  ::free(mptr);
+}
+
+//==================================================================================================
+TEST(AllocTest, test_size_class) {
+  for (std::size_t i = 0; i < local::PoolsRAII::BUCKETS; ++i) {
+    const sp::bucket_size bucketSz = shared::pool_bucket_size(i);
+    ASSERT_EQ(i, shared::pool_index(bucketSz));
+    ASSERT_EQ(std::size_t(bucketSz),
+              std::size_t(shared::bucket_size_for(std::size_t(bucketSz))));
+    if (i > 0) {
+      ASSERT_TRUE(shared::pool_bucket_size(i - 1) < bucketSz);
+    }
+
+    const shared::SizeClass &sizeClass = shared::size_class(i);
+    ASSERT_EQ(std::size_t(bucketSz), sizeClass.bucket_size);
+    ASSERT_EQ(std::size_t(0), sizeClass.node_size % SP_MALLOC_PAGE_SIZE);
+    ASSERT_TRUE(sizeClass.buckets > 0);
+    ASSERT_TRUE(sizeClass.buckets <= header::Extent::max_buckets);
+    ASSERT_TRUE(sizeClass.node_size >=
+                header::SIZE + sizeClass.buckets * sizeClass.bucket_size);
+    ASSERT_EQ(i, shared::size_class_index(sizeClass.bucket_size));
+  }
+
+  for (std::size_t sz = 1; sz <= SP_MALLOC_LARGE_THRESHOLD; ++sz) {
+    const std::size_t bucketSz(shared::bucket_size_for(sz));
+    ASSERT_TRUE(bucketSz >= sz);
+    ASSERT_EQ(roundAlloc(sz), bucketSz);
+    if (sz > 64) {
+      // at most 25% internal fragmentation
+      ASSERT_TRUE((bucketSz - sz) * 4 < bucketSz);
+    }
+  }
+  ASSERT_EQ(std::size_t(5120), std::size_t(shared::bucket_size_for(4100)));
+  // above the threshold lengths are mapped directly and have no class
+  ASSERT_EQ(std::size_t(0), std::size_t(shared::bucket_size_for(
+                                SP_MALLOC_LARGE_THRESHOLD + 1)));
+  ASSERT_EQ(std::size_t(0),
+            std::size_t(shared::bucket_size_for(~std::size_t(0))));
+}
+
+//==================================================================================================
+TEST(AllocTest, test_bucket_index) {
+  for (std::size_t bucketSz : {8, 24, 48, 64, 80, 112, 4096, 5120}) {
+    const sp::buckets buckets(header::Extent::max_buckets);
+    header::Node node(header::NodeType::HEAD,
+                      sp::node_size(header::SIZE + bucketSz * buckets),
+                      sp::bucket_size(bucketSz), buckets);
+
+    for (std::size_t i = 0; i < std::size_t(buckets); ++i) {
+      auto index = header::bucket_index(&node, i * bucketSz);
+      ASSERT_TRUE(bool(index));
+      ASSERT_EQ(i, std::size_t(index.get()));
+      if (bucketSz > 8) {
+        ASSERT_FALSE(bool(header::bucket_index(&node, i * bucketSz + 8)));
+      }
+
+      std::uintptr_t ptr =
+          reinterpret_cast<std::uintptr_t>(header::bucket_at(&node, i));
+      ASSERT_EQ(header::node_data_start(&node) + i * bucketSz, ptr);
+    }
+  }
+}
+
+//==================================================================================================
+TEST(AllocTest, test_pools_find_pruned) {
+  local::PoolsRAII pools;
+  // pools_find() only inspects the address, the extent is never dereferenced
+  const std::uintptr_t extent = std::uintptr_t(1) << 32;
+  pools.range.min.store(extent);
+  pools.range.max.store(extent * 2);
+
+  for (std::size_t i = 0; i < local::PoolsRAII::BUCKETS; ++i) {
+    const shared::SizeClass &sizeClass = shared::size_class(i);
+    for (std::size_t b = 0; b < std::min(sizeClass.buckets, std::size_t(64));
+         ++b) {
+      const std::uintptr_t ptr =
+          extent + header::SIZE + (b * sizeClass.bucket_size);
+      struct Arg {
+        local::Pool *owner;
+        std::size_t visited;
+      } arg{&pools[i], 0};
+
+      auto found = local::pools_find<bool, Arg>(
+          pools, reinterpret_cast<void *>(ptr),
+          [](local::Pool &pool, void *, Arg &a) -> sp::maybe<bool> {
+            ++a.visited;
+            if (&pool == a.owner) {
+              return sp::maybe<bool>(true);
+            }
+            return {};
+          },
+          arg);
+      ASSERT_TRUE(bool(found));
+      ASSERT_TRUE(arg.visited <= i + 1);
+
+      if (sizeClass.bucket_size == 8 && b % 2 == 1) {
+        // only classes of odd multiples of 8 can own an odd bucket of 8
+        ASSERT_TRUE(arg.visited <= shared::pool_shift_limit(3));
+        ASSERT_TRUE(shared::pool_shift_limit(3) < local::PoolsRAII::BUCKETS);
+      }
+    }
+  }
+}
+
+//==================================================================================================
+TEST(AllocTest, test_local_alloc_aligned_start) {
+  local::PoolsRAII pool;
+  constexpr std::size_t page = SP_MALLOC_PAGE_SIZE;
+  // the range starts at the alignment but is too small to place the
+  // allocation higher up, [result:2 pages][suffix:1 page]
+  uint8_t *const mptr = (uint8_t *)aligned_alloc(page * 2, page * 4);
+  LocalFree *const free = header::init_local_free(mptr, sp::node_size(page * 3));
+  local::dealloc(pool, free, free);
+
+  void *const ptr = local::alloc(pool, sp::node_size(page * 2), page * 2);
+  ASSERT_EQ((void *)mptr, ptr);
+  ASSERT_EQ(std::size_t(0), pool.free_bytes);
+
+  ASSERT_TRUE(debug::local_free_list_merge_stack_to_tree(pool));
+  auto local_free = debug::local_free_get_free(pool);
+  ASSERT_EQ(std::size_t(1), local_free.size());
+  ASSERT_EQ((void *)(mptr + page * 2), std::get<0>(local_free[0]));
+  ASSERT_EQ(page, std::get<1>(local_free[0]));
+  ASSERT_EQ(page, pool.free_bytes);
+
+  ::free(mptr);
+}
+
+//==================================================================================================
+TEST(AllocTest, test_trim_free_list) {
+  global::State global;
+  local::PoolsRAII pool;
+
+  // nothing is in use so the high watermark is SP_MALLOC_FREE_HIGH_MIN
+  const std::size_t length = SP_MALLOC_FREE_HIGH_MIN * 2;
+  void *const ptr =
+      global::alloc(global, sp::pages(length >> SP_MALLOC_PAGE_SHIFT));
+  ASSERT_FALSE(ptr == nullptr);
+  LocalFree *const free =
+      header::init_local_free(ptr, sp::node_size(length));
+  local::dealloc(pool, free, free);
+
+  // trimmed down to the low watermark
+  const std::size_t keep = SP_MALLOC_FREE_HIGH_MIN / 2;
+  ASSERT_EQ(length - keep, local::trim(global, pool));
+  ASSERT_EQ(keep, pool.free_bytes);
+  // below the high watermark nothing is returned
+  ASSERT_EQ(std::size_t(0), local::trim(global, pool));
+
+  auto local_free = debug::local_free_get_free(pool);
+  ASSERT_EQ(std::size_t(1), local_free.size());
+  ASSERT_EQ(ptr, std::get<0>(local_free[0]));
+  ASSERT_EQ(keep, std::get<1>(local_free[0]));
+
+  // the tail may have been coalesced with its neighbours in global
+  uint8_t *const start = static_cast<uint8_t *>(ptr) + keep;
+  uint8_t *const end = static_cast<uint8_t *>(ptr) + length;
+  bool returned = false;
+  for (auto &current : debug::global_get_free(global)) {
+    uint8_t *const free_start = static_cast<uint8_t *>(std::get<0>(current));
+    if (free_start <= start && free_start + std::get<1>(current) >= end) {
+      returned = true;
+    }
+  }
+  ASSERT_TRUE(returned);
+}
+
+//==================================================================================================
+TEST(AllocTest, test_empty_extent_cache) {
+  using shared::FreeCode;
+  global::State global;
+  local::PoolsRAII pool;
+  shared::State state{global, pool, pool};
+  const std::size_t allocSz = 64;
+  const local::Pool &sizeClass = pool[shared::size_class_index(allocSz)];
+
+  void *const first = shared::alloc(global, pool, allocSz);
+  ASSERT_FALSE(first == nullptr);
+  header::Node *const extent = pagemap::lookup(first).get().node;
+
+  // the empty extent is kept by its size class instead of the free list
+  ASSERT_EQ(FreeCode::FREED, shared::free(state, first));
+  ASSERT_EQ(std::size_t(1), sizeClass.empty_length);
+  ASSERT_EQ(extent, sizeClass.empty);
+  ASSERT_FALSE(bool(pagemap::lookup(first)));
+  ASSERT_EQ(std::size_t(0), pool.total_alloc.load());
+  ASSERT_TRUE(pool.free_stack.load() == nullptr);
+
+  // and reused by the next extent of the size class
+  void *const second = shared::alloc(global, pool, allocSz);
+  ASSERT_FALSE(second == nullptr);
+  ASSERT_EQ(extent, pagemap::lookup(second).get().node);
+  ASSERT_EQ(std::size_t(0), sizeClass.empty_length);
+  ASSERT_EQ(std::size_t(extent->node_size), pool.total_alloc.load());
+
+  ASSERT_EQ(FreeCode::FREED, shared::free(state, second));
+  ASSERT_EQ(std::size_t(1), sizeClass.empty_length);
+  shared::flush_empty_extents(pool);
+  ASSERT_EQ(std::size_t(0), sizeClass.empty_length);
+  ASSERT_TRUE(sizeClass.empty == nullptr);
+
+  ASSERT_TRUE(debug::local_free_list_merge_stack_to_tree(pool));
+  auto local_free = debug::local_free_get_free(pool);
+  ASSERT_EQ(std::size_t(1), local_free.size());
+  ASSERT_EQ((void *)extent, std::get<0>(local_free[0]));
+}
+
+//==================================================================================================
+struct FreeStackPushArg {
+  local::PoolsRAII &pool;
+  LocalFree *const nodes;
+  const std::size_t pushes;
+  sp::Barrier start;
+  std::atomic<std::size_t> next_thread;
+  std::atomic<std::size_t> pushing;
+  std::atomic<std::size_t> drains;
+
+  FreeStackPushArg(local::PoolsRAII &p, LocalFree *n, std::size_t ps,
+                   std::size_t threads)
+      : pool(p)
+      , nodes(n)
+      , pushes(ps)
+      , start(threads + 1)
+      , next_thread(0)
+      , pushing(threads)
+      , drains(0) {
+  }
+};
+
+static void *
+worker_free_stack_push(void *a) {
+  auto *arg = (FreeStackPushArg *)a;
+  LocalFree *const nodes = arg->nodes + (arg->next_thread++ * arg->pushes);
+  for (std::size_t i = 0; i < arg->pushes; ++i) {
+    header::init_local_free(nodes + i, sp::node_size(sizeof(LocalFree)));
+  }
+  arg->start.await();
+
+  for (std::size_t i = 0; i < arg->pushes; ++i) {
+    local::dealloc(arg->pool, nodes + i, nodes + i);
+  }
+  --arg->pushing;
+  return nullptr;
+}
+
+static void *
+worker_free_stack_drain(void *a) {
+  auto *arg = (FreeStackPushArg *)a;
+  arg->start.await();
+
+  bool pushing = true;
+  while (pushing) {
+    pushing = arg->pushing.load() > 0;
+    if (debug::local_free_list_merge_stack_to_tree(arg->pool)) {
+      ++arg->drains;
+    }
+  }
+  return nullptr;
+}
+
+TEST(AllocTest, test_free_stack_concurrent_push) {
+  constexpr std::size_t THREADS = 4;
+  constexpr std::size_t PUSHES = 1024 * 64;
+  constexpr std::size_t nodes = THREADS * PUSHES;
+
+  local::PoolsRAII pool;
+  LocalFree *const begin = new LocalFree[nodes];
+  Range range((uint8_t *)begin, nodes * sizeof(LocalFree));
+  FreeStackPushArg arg(pool, begin, PUSHES, THREADS);
+
+  std::vector<Worker_t> workers(THREADS, worker_free_stack_push);
+  workers.push_back(worker_free_stack_drain);
+
+  threads(arg, workers);
+
+  // every pushed node was drained exactly once and coalesced into one range
+  ASSERT_TRUE(pool.free_stack.load() == nullptr);
+  ASSERT_EQ(range.length, pool.free_bytes);
+  auto local_free = debug::local_free_get_free(pool);
+  ASSERT_EQ(std::size_t(1), local_free.size());
+  ASSERT_EQ(range.length, std::get<1>(local_free[0]));
+
+  delete[] begin;
+}
+
 //==================================================================================================
 static std::size_t
 tree_nodes(LocalFree *tree) {
@@ -229,6 +669,49 @@ valid_binary_tree(LocalFree *const current) {
   return true;
 }
 
+// @return the height of @current or -1 if it is not AVL balanced
+static int
+balanced_height(LocalFree *const current) {
+  if (current == nullptr) {
+    return 0;
+  }
+  const int l = balanced_height(current->left);
+  const int r = balanced_height(current->right);
+  if (l < 0 || r < 0 || l - r > 1 || r - l > 1) {
+    return -1;
+  }
+  return std::max(l, r) + 1;
+}
+
+// @return the height of the size tree @current or -1 if it is not AVL balanced
+// or not ordered by [size, address]
+static int
+balanced_size_height(LocalFree *const current, std::size_t &nodes) {
+  if (current == nullptr) {
+    return 0;
+  }
+  auto less = [](const LocalFree *a, const LocalFree *b) {
+    if (a->size != b->size) {
+      return a->size < b->size;
+    }
+    return a < b;
+  };
+  if (current->size_left && !less(current->size_left, current)) {
+    return -1;
+  }
+  if (current->size_right && !less(current, current->size_right)) {
+    return -1;
+  }
+
+  ++nodes;
+  const int l = balanced_size_height(current->size_left, nodes);
+  const int r = balanced_size_height(current->size_right, nodes);
+  if (l < 0 || r < 0 || l - r > 1 || r - l > 1) {
+    return -1;
+  }
+  return std::max(l, r) + 1;
+}
+
 template <std::size_t SIZE>
 static void
 random_offset(std::size_t (&offset)[SIZE]) {
@@ -478,6 +961,11 @@ assert_after(local::PoolsRAII &pool, Range &range) {
   ASSERT_FALSE(tree == nullptr);
   assert_tree_consecutive_range(tree, range);
   ASSERT_TRUE(valid_binary_tree(tree));
+  ASSERT_TRUE(balanced_height(tree) > 0);
+
+  std::size_t size_nodes = 0;
+  ASSERT_TRUE(balanced_size_height(pool.free_size, size_nodes) > 0);
+  ASSERT_EQ(tree_nodes(tree), size_nodes);
 
   print_tree(range, pool);
   ASSERT_EQ(range.length, tree_byte_size(tree));
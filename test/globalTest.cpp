@@ -4,6 +4,7 @@
 #include "Util.h"
 #include <global.h>
 #include <global_debug.h>
+#include <numa_debug.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <thread>
@@ -15,6 +16,12 @@ free_entries(global::State &state) {
   return free.size();
 }
 
+static sp::pages
+pages_of(std::size_t length) {
+  assert(length % SP_MALLOC_PAGE_SIZE == 0);
+  return sp::pages(length / SP_MALLOC_PAGE_SIZE);
+}
+
 /*Parametrized Fixture*/
 class GlobalTest : public testing::TestWithParam<size_t> {
 public:
@@ -34,23 +41,13 @@ public:
 /*Setup Parameters*/
 INSTANTIATE_TEST_CASE_P(Default, GlobalTest,
                         ::testing::Values( //
-                            64             //
-                            ,
-                            128 //
-                            ,
-                            256 //
-                            ,
-                            512 //
-                            ,
-                            1024 //
-                            ,
-                            2048 //
-                            ,
-                            4096 //
+                            4096           //
                             ,
                             8192 //
                             ,
                             16384 //
+                            ,
+                            32768 //
                             ));
 
 /*Util*/
@@ -67,7 +64,7 @@ start:
     void *const start = (void *)range.raw_offset(offset);
 
     // printf("global::dealloc(state, %p, %zu)\n", start, bSz);
-    global::dealloc(state, start, bSz);
+    global::dealloc(state, start, pages_of(bSz));
 
     // printf("[%p,%zu]", start, bucketSz);
     goto start;
@@ -96,7 +93,7 @@ start:
 
   std::random_shuffle(points.begin(), points.end());
   for (auto &start : points) {
-    global::dealloc(state, start, bSz);
+    global::dealloc(state, start, pages_of(bSz));
   }
 }
 
@@ -147,7 +144,7 @@ assert_dummy_alloc(global::State &state, size_t size, Range &range,
   // printf("assert_dummy_dealloc\n");
   for (size_t i = 0; i < size; i += std::size_t(bSz)) {
   retry:
-    void *const current = global::find_free(state, bSz);
+    void *const current = global::find_free(state, pages_of(bSz));
     if (current == nullptr) {
       // printf("null\m");
       goto retry;
@@ -164,7 +161,7 @@ TEST_P(GlobalTest, dealloc_alloc_symmetric) {
 
   const size_t SIZE = 1024 * 64;
   // alignas(64) uint8_t range[SIZE];
-  uint8_t *const startR = (uint8_t *)aligned_alloc(64, SIZE * 2);
+  uint8_t *const startR = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, SIZE * 2);
   ASSERT_FALSE(startR == nullptr);
   memset(startR, 0, SIZE * 2);
   Range range(startR, SIZE);
@@ -189,12 +186,257 @@ TEST_P(GlobalTest, dealloc_alloc_symmetric) {
   free(startR);
 }
 
+TEST_P(GlobalTest, alloc_arena_commit) {
+  const sp::node_size sz(GetParam());
+  const std::size_t allocs = 64;
+
+  uint8_t *first = nullptr;
+  for (std::size_t i = 0; i < allocs; ++i) {
+    uint8_t *const ptr = (uint8_t *)global::alloc(state, pages_of(sz));
+    ASSERT_FALSE(ptr == nullptr);
+    // committed memory is writable
+    memset(ptr, 0xff, std::size_t(sz));
+    if (!first) {
+      first = ptr;
+    }
+    // carved from the same reservation
+    ASSERT_TRUE(ptr >= first);
+    ASSERT_TRUE(ptr + std::size_t(sz) <= first + SP_MALLOC_ARENA_RESERVE);
+  }
+
+  ASSERT_TRUE(state.arena_alloc >= allocs * std::size_t(sz));
+  ASSERT_TRUE(state.arena_position <= state.arena_end);
+  ASSERT_EQ(std::size_t(0), state.arena_alloc % SP_MALLOC_PAGE_SIZE);
+}
+
+TEST_P(GlobalTest, purge_idle_free) {
+  const std::size_t pages = 16;
+  const sp::node_size sz(SP_MALLOC_PAGE_SIZE * pages);
+  uint8_t *const first = (uint8_t *)global::alloc(state, pages_of(sz));
+  ASSERT_FALSE(first == nullptr);
+  memset(first, 0xff, std::size_t(sz));
+  global::dealloc(state, first, pages_of(sz));
+
+  const std::uint64_t now = util::monotonic_ms();
+  // not idle long enough
+  ASSERT_EQ(std::size_t(0), global::purge(state, now));
+  ASSERT_TRUE(global::purge(state, now + SP_MALLOC_PURGE_DECAY_MS) >=
+              std::size_t(sz));
+  // already purged
+  ASSERT_EQ(std::size_t(0),
+            global::purge(state, now + SP_MALLOC_PURGE_DECAY_MS));
+  // the pages after the Free header reads as zero once purged
+  ASSERT_EQ(uint8_t(0), first[SP_MALLOC_PAGE_SIZE]);
+  ASSERT_EQ(uint8_t(0), first[std::size_t(sz) - 1]);
+
+  // dirty ranges are preferred over purged ones
+  const sp::node_size small(GetParam());
+  uint8_t *const dirty = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, std::size_t(small));
+  global::dealloc(state, dirty, pages_of(small));
+  ASSERT_EQ(dirty, global::alloc(state, pages_of(small)));
+  free(dirty);
+}
+
+TEST_P(GlobalTest, purge_many_idle_free) {
+  const std::size_t page = SP_MALLOC_PAGE_SIZE;
+  const std::size_t length = util::round_up(GetParam(), page) + page;
+  // more than a single batch of purged ranges
+  const std::size_t ranges = 200;
+  uint8_t *const startR =
+      (uint8_t *)aligned_alloc(page, (length + page) * ranges);
+  ASSERT_FALSE(startR == nullptr);
+  // [range][gap][range][gap]...
+  for (std::size_t i = 0; i < ranges; ++i) {
+    global::dealloc(state, startR + (length + page) * i, pages_of(length));
+  }
+  ASSERT_EQ(ranges, free_entries(state));
+
+  const std::uint64_t now = util::monotonic_ms() + SP_MALLOC_PURGE_DECAY_MS;
+  ASSERT_EQ(length * ranges, global::purge(state, now));
+  ASSERT_EQ(std::size_t(0), global::purge(state, now));
+  ASSERT_EQ(ranges, free_entries(state));
+  free(startR);
+}
+
+TEST_P(GlobalTest, find_free_best_fit) {
+  const std::size_t page = SP_MALLOC_PAGE_SIZE;
+  const std::size_t length = GetParam();
+  const std::size_t small = util::round_up(length, page);
+  const std::size_t big = page * 32;
+
+  uint8_t *const startR = (uint8_t *)aligned_alloc(page, big * 3);
+  ASSERT_FALSE(startR == nullptr);
+  // [big][gap][small]
+  uint8_t *const smallR = startR + big * 2;
+  global::dealloc(state, startR, pages_of(big));
+  global::dealloc(state, smallR, pages_of(small));
+  ASSERT_EQ(std::size_t(2), free_entries(state));
+
+  // the address first range fits but the smaller range is a better fit
+  uint8_t *const res = (uint8_t *)global::find_free(state, pages_of(length));
+  ASSERT_TRUE(res >= smallR && res + length <= smallR + small);
+
+  uint8_t *const rest =
+      (uint8_t *)global::find_free(state, pages_of(big - page));
+  ASSERT_TRUE(rest >= startR && rest + (big - page) <= startR + big);
+  free(startR);
+}
+
+TEST_P(GlobalTest, alloc_aligned_pages) {
+  const std::size_t page = SP_MALLOC_PAGE_SIZE;
+  const sp::pages pages(pages_of(GetParam()));
+  const std::size_t alignment = page * 16;
+
+  uint8_t *const startR = (uint8_t *)aligned_alloc(alignment, alignment * 4);
+  ASSERT_FALSE(startR == nullptr);
+  // the span starts one page after an aligned page
+  global::dealloc(state, startR + page, pages_of(alignment * 3));
+
+  uint8_t *const res = (uint8_t *)global::alloc(state, pages, alignment);
+  ASSERT_FALSE(res == nullptr);
+  ASSERT_EQ(std::size_t(0), reinterpret_cast<std::uintptr_t>(res) % alignment);
+  ASSERT_TRUE(res >= startR + page);
+  ASSERT_TRUE(res + std::size_t(pages) * page <=
+              startR + page + alignment * 3);
+  // [prefix][res][suffix] the unaligned remainders are returned
+  ASSERT_EQ(alignment * 3 - std::size_t(pages) * page,
+            size_of_free(debug::global_get_free(state)));
+
+  global::dealloc(state, res, pages);
+  ASSERT_EQ(std::size_t(1), free_entries(state));
+  free(startR);
+}
+
+TEST_P(GlobalTest, alloc_aligned_exact) {
+  const std::size_t page = SP_MALLOC_PAGE_SIZE;
+  const sp::pages pages(pages_of(util::round_up(GetParam(), page)));
+  const std::size_t alignment = page * 16;
+
+  uint8_t *const startR = (uint8_t *)aligned_alloc(alignment, alignment * 8);
+  ASSERT_FALSE(startR == nullptr);
+  // [gap][large:unaligned][gap][exact:aligned]
+  uint8_t *const exact = startR + alignment * 4;
+  global::dealloc(state, startR + page, pages_of(alignment * 3));
+  global::dealloc(state, exact, pages);
+
+  // the aligned exact fit is preferred over splitting the padded best fit
+  ASSERT_EQ(exact, global::alloc(state, pages, alignment));
+  ASSERT_EQ(std::size_t(1), free_entries(state));
+  ASSERT_EQ(alignment * 3, size_of_free(debug::global_get_free(state)));
+
+  // without an aligned exact fit the large span is split
+  uint8_t *const res = (uint8_t *)global::alloc(state, pages, alignment);
+  ASSERT_FALSE(res == nullptr);
+  ASSERT_EQ(std::size_t(0), reinterpret_cast<std::uintptr_t>(res) % alignment);
+  ASSERT_TRUE(res > startR && res < exact);
+  free(startR);
+}
+
+TEST_P(GlobalTest, alloc_steal_sibling) {
+  const std::size_t page = SP_MALLOC_PAGE_SIZE;
+  const sp::node_size sz(util::round_up(GetParam(), page));
+  global::State arenas[3];
+  debug::numa_fake_topology(1, 0);
+  global::link(arenas, 3);
+  debug::numa_fake_topology(0, 0);
+
+  uint8_t *const startR = (uint8_t *)aligned_alloc(page, std::size_t(sz));
+  ASSERT_FALSE(startR == nullptr);
+  global::dealloc(arenas[2], startR, pages_of(sz));
+
+  // the first arena is exhausted and steals from its sibling before growing
+  ASSERT_EQ(startR, global::alloc(arenas[0], pages_of(sz)));
+  ASSERT_EQ(std::size_t(0), arenas[0].arena_alloc);
+  ASSERT_EQ(size_t(0), free_entries(arenas[2]));
+
+  // nothing left to steal
+  uint8_t *const grown = (uint8_t *)global::alloc(arenas[0], pages_of(sz));
+  ASSERT_FALSE(grown == nullptr);
+  ASSERT_TRUE(arenas[0].arena_alloc >= std::size_t(sz));
+  free(startR);
+}
+
+TEST_P(GlobalTest, dealloc_reserving_arena) {
+  const std::size_t page = SP_MALLOC_PAGE_SIZE;
+  const sp::node_size sz(util::round_up(GetParam(), page));
+  global::State arenas[2];
+  debug::numa_fake_topology(1, 0);
+  global::link(arenas, 2);
+  debug::numa_fake_topology(0, 0);
+
+  uint8_t *const ptr = (uint8_t *)global::alloc(arenas[0], pages_of(sz));
+  ASSERT_FALSE(ptr == nullptr);
+  const std::size_t before = size_of_free(debug::global_get_free(arenas[0]));
+
+  // returned to the arena which reserved it, not the one of the caller
+  global::dealloc(arenas[1], ptr, pages_of(sz));
+  ASSERT_EQ(size_t(0), free_entries(arenas[1]));
+  ASSERT_EQ(before + std::size_t(sz),
+            size_of_free(debug::global_get_free(arenas[0])));
+
+  // memory outside of every reservation is kept by the caller
+  uint8_t *const startR = (uint8_t *)aligned_alloc(page, std::size_t(sz));
+  ASSERT_FALSE(startR == nullptr);
+  global::dealloc(arenas[1], startR, pages_of(sz));
+  ASSERT_EQ(size_t(1), free_entries(arenas[1]));
+  free(startR);
+}
+
+TEST_P(GlobalTest, alloc_numa_arenas) {
+  const std::size_t page = SP_MALLOC_PAGE_SIZE;
+  const sp::node_size sz(util::round_up(GetParam(), page));
+  global::State arenas[4];
+  // [0:node0][1:node1][2:node0][3:node1]
+  debug::numa_fake_topology(2, 1);
+  global::link(arenas, 4);
+  ASSERT_EQ(std::size_t(1), arenas[3].node);
+  ASSERT_EQ(&arenas[1], &global::arena_of(arenas, 4, numa::current(), 0));
+  ASSERT_EQ(&arenas[3], &global::arena_of(arenas, 4, numa::current(), 1));
+  ASSERT_EQ(&arenas[1], &global::arena_of(arenas, 4, numa::current(), 2));
+  ASSERT_EQ(&arenas[2], &global::arena_of(arenas, 4, 0, 1));
+  // more nodes than arenas
+  debug::numa_fake_topology(8, 5);
+  ASSERT_EQ(&arenas[1], &global::arena_of(arenas, 4, numa::current(), 1));
+  debug::numa_fake_topology(0, 0);
+
+  uint8_t *const startR = (uint8_t *)aligned_alloc(page, std::size_t(sz));
+  ASSERT_FALSE(startR == nullptr);
+  global::dealloc(arenas[1], startR, pages_of(sz));
+
+  // remote node memory is not stolen
+  uint8_t *const local = (uint8_t *)global::alloc(arenas[0], pages_of(sz));
+  ASSERT_FALSE(local == nullptr);
+  ASSERT_NE(startR, local);
+  ASSERT_EQ(size_t(1), free_entries(arenas[1]));
+  // sibling on the same node is
+  ASSERT_EQ(startR, global::alloc(arenas[3], pages_of(sz)));
+  free(startR);
+}
+
+TEST_P(GlobalTest, dealloc_random_coalesce) {
+  const sp::node_size sz(GetParam());
+
+  const size_t SIZE = 1024 * 64;
+  uint8_t *const startR = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, SIZE);
+  ASSERT_FALSE(startR == nullptr);
+  Range range(startR, SIZE);
+
+  // neighbours on both sides are coalesced regardless of the order
+  dealloc_rand_setup(state, range, sz);
+  assert_dummy_dealloc(state, range);
+
+  Points result;
+  assert_dummy_alloc(state, range.length, range, sz, result);
+  ASSERT_EQ(size_t(0), free_entries(state));
+  free(startR);
+}
+
 TEST_P(GlobalTest, dealloc_doubling_alloc) {
   const sp::node_size sz(GetParam());
 
   const size_t SIZE = 1024 * 64;
   // alignas(64) uint8_t range[SIZE];
-  uint8_t *const startR = (uint8_t *)aligned_alloc(64, SIZE);
+  uint8_t *const startR = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, SIZE);
   ASSERT_FALSE(startR == nullptr);
   memset(startR, 0, SIZE);
   Range range(startR, SIZE);
@@ -216,10 +458,10 @@ TEST_P(GlobalTest, dealloc_doubling_alloc) {
 TEST_P(GlobalTest, dealloc_half_alloc) {
   const sp::node_size sz(GetParam());
 
-  if (sz != 64) { // 64 is the minimum size
+  if (sz != SP_MALLOC_PAGE_SIZE) { // a page is the minimum size
     const size_t SIZE = 1024 * 64;
     // alignas(64) uint8_t range[SIZE];
-    uint8_t *const startR = (uint8_t *)aligned_alloc(64, SIZE);
+    uint8_t *const startR = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, SIZE);
     ASSERT_FALSE(startR == nullptr);
     memset(startR, 0, SIZE);
     Range range(startR, SIZE);
@@ -371,7 +613,7 @@ threaded_dealloc_test(global::State &state, size_t sz, void *(*f)(void *)) {
   const size_t RANGE_SIZE = SIZE * thCnt;
   // printf("range_size: %zu\n", RANGE_SIZE);
 
-  uint8_t *const startR = (uint8_t *)aligned_alloc(64, RANGE_SIZE);
+  uint8_t *const startR = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, RANGE_SIZE);
   ASSERT_FALSE(startR == nullptr);
   memset(startR, 0, RANGE_SIZE);
   Range range(startR, RANGE_SIZE);
@@ -466,7 +708,7 @@ threaded_dealloc_alloc_test(global::State &state, size_t sz,
   const size_t RANGE_SIZE = SIZE * thCnt;
   // printf("range_size: %zu\n", RANGE_SIZE);
 
-  uint8_t *const startR = (uint8_t *)aligned_alloc(64, RANGE_SIZE);
+  uint8_t *const startR = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, RANGE_SIZE);
   ASSERT_FALSE(startR == nullptr);
   memset(startR, 0, RANGE_SIZE);
   Range range(startR, RANGE_SIZE);
@@ -520,7 +762,7 @@ threaded_dealloc_threaded_alloc_test(global::State &state,
   const size_t RANGE_SIZE = SIZE * thDealloc;
   // printf("range_size: %zu\n", RANGE_SIZE);
 
-  uint8_t *const startR = (uint8_t *)aligned_alloc(64, RANGE_SIZE);
+  uint8_t *const startR = (uint8_t *)aligned_alloc(SP_MALLOC_PAGE_SIZE, RANGE_SIZE);
   ASSERT_FALSE(startR == nullptr);
   memset(startR, 0, RANGE_SIZE);
   Range range(startR, RANGE_SIZE);
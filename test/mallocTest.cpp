@@ -4,11 +4,14 @@
 #include "Util.h"
 #include "shared.h"
 #include <global_debug.h>
+#include <algorithm>
 #include <initializer_list>
 #include <malloc.h>
 #include <malloc_debug.h>
+#include <pagemap.h>
 #include <pthread.h>
 #include <stuff_debug.h>
+#include <sys/mman.h>
 #include <tuple>
 #include <vector>
 
@@ -867,6 +870,157 @@ TEST_P(MallocTestAllocSizePFixture, 6colour_wait_assert_free) {
   test_color_wait_assert_free(allocSz, workers);
 }
 
+//-----------------------------------------
+static void *
+worker_free_remote(void *arg) {
+  auto *ptrs = (std::vector<void *> *)arg;
+  // global::free() requires the thread local pools of the freeing thread
+  void *const own = sp_malloc(8);
+  for (void *ptr : *ptrs) {
+    EXPECT_TRUE(sp_free(ptr));
+  }
+  EXPECT_TRUE(sp_free(own));
+  return nullptr;
+}
+
+static void *
+worker_remote_free_reuse(void *) {
+  constexpr std::size_t allocSz = 32;
+  constexpr std::size_t allocs = 2048;
+
+  std::vector<void *> keep;
+  std::vector<void *> remote;
+  std::vector<header::Node *> extents;
+  for (std::size_t i = 0; i < allocs; ++i) {
+    void *const ptr = sp_malloc(allocSz);
+    EXPECT_FALSE(ptr == nullptr);
+    auto entry = pagemap::lookup(ptr);
+    EXPECT_TRUE(bool(entry));
+    extents.push_back(entry.get().node);
+    // keep one bucket of each 8 so that no extent becomes empty
+    (i % 8 == 0 ? keep : remote).push_back(ptr);
+  }
+  std::sort(extents.begin(), extents.end());
+
+  // freed through the remote free stack of this thread
+  threads(remote, {worker_free_remote});
+
+  // the remote freed buckets are reused instead of allocating new extents
+  for (std::size_t i = 0; i < remote.size(); ++i) {
+    void *const ptr = sp_malloc(allocSz);
+    EXPECT_FALSE(ptr == nullptr);
+    header::Node *const node = pagemap::lookup(ptr).get().node;
+    EXPECT_TRUE(std::binary_search(extents.begin(), extents.end(), node));
+    keep.push_back(ptr);
+  }
+
+  for (void *ptr : keep) {
+    EXPECT_TRUE(sp_free(ptr));
+  }
+  return nullptr;
+}
+
+TEST_F(MallocTest, test_remote_free_reuse) {
+  void *arg = nullptr;
+  threads(1, arg, worker_remote_free_reuse);
+}
+
+//-----------------------------------------
+TEST_F(MallocTest, test_large) {
+  const std::size_t page = SP_MALLOC_PAGE_SIZE;
+  const std::size_t length = (1024 * 1024) + 1;
+
+  uint8_t *const ptr = (uint8_t *)sp_malloc(length);
+  ASSERT_FALSE(ptr == nullptr);
+  ASSERT_EQ(std::size_t(0), reinterpret_cast<std::uintptr_t>(ptr) % page);
+  // exactly the page rounded length
+  ASSERT_EQ(util::round_up(length, page), sp_usable_size(ptr));
+  // not part of any pool
+  ASSERT_EQ(std::size_t(0), debug::malloc_count_alloc());
+  memset(ptr, 0xab, length);
+
+  ASSERT_EQ(ptr, sp_realloc(ptr, sp_usable_size(ptr)));
+  uint8_t *const grown = (uint8_t *)sp_realloc(ptr, length * 2);
+  ASSERT_FALSE(grown == nullptr);
+  ASSERT_EQ(util::round_up(length * 2, page), sp_usable_size(grown));
+  ASSERT_EQ(uint8_t(0xab), grown[0]);
+  ASSERT_EQ(uint8_t(0xab), grown[length - 1]);
+
+  // shrinking releases the tail pages
+  uint8_t *const shrunk = (uint8_t *)sp_realloc(grown, length);
+  ASSERT_FALSE(shrunk == nullptr);
+  ASSERT_EQ(util::round_up(length, page), sp_usable_size(shrunk));
+  ASSERT_EQ(uint8_t(0xab), shrunk[length - 1]);
+
+  // below the threshold the tail pages are released in place
+  uint8_t *const trimmed = (uint8_t *)sp_realloc(shrunk, page + 1);
+  ASSERT_EQ(shrunk, trimmed);
+  ASSERT_EQ(page * 2, sp_usable_size(trimmed));
+  ASSERT_EQ(uint8_t(0xab), trimmed[page]);
+  ASSERT_TRUE(sp_free(trimmed));
+
+  // a pool allocation grows into a large one
+  uint8_t *const small = (uint8_t *)sp_malloc(64);
+  ASSERT_FALSE(small == nullptr);
+  memset(small, 0xcd, 64);
+  uint8_t *const big = (uint8_t *)sp_realloc(small, length);
+  ASSERT_FALSE(big == nullptr);
+  ASSERT_EQ(util::round_up(length, page), sp_usable_size(big));
+  ASSERT_EQ(uint8_t(0xcd), big[63]);
+  ASSERT_EQ(std::size_t(0), debug::malloc_count_alloc());
+  ASSERT_TRUE(sp_free(big));
+}
+
+TEST_F(MallocTest, test_large_realloc_move) {
+  const std::size_t page = SP_MALLOC_PAGE_SIZE;
+  const std::size_t length = (1024 * 1024) + 1;
+  const std::size_t memSz = util::round_up(length, page);
+
+  uint8_t *const ptr = (uint8_t *)sp_malloc(length);
+  ASSERT_FALSE(ptr == nullptr);
+  memset(ptr, 0xab, length);
+  // the page after the allocation is taken so it can not grow in place, when
+  // the hint is not honoured the page is already in use
+  void *const guard = ::mmap(ptr + memSz, page, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_FALSE(guard == MAP_FAILED);
+
+  uint8_t *const grown = (uint8_t *)sp_realloc(ptr, length * 2);
+  ASSERT_FALSE(grown == nullptr);
+  ASSERT_NE(ptr, grown);
+  ASSERT_EQ(util::round_up(length * 2, page), sp_usable_size(grown));
+  ASSERT_EQ(uint8_t(0xab), grown[0]);
+  ASSERT_EQ(uint8_t(0xab), grown[length - 1]);
+  // the grown tail is writable
+  memset(grown + length, 0xcd, length);
+  // the old address is no longer a large allocation
+  ASSERT_EQ(std::size_t(0), sp_usable_size(ptr));
+
+  ASSERT_TRUE(sp_free(grown));
+  ::munmap(guard, page);
+}
+
+TEST_F(MallocTest, test_realloc_shrink) {
+  const std::size_t length = 64 * 1024;
+  uint8_t *const ptr = (uint8_t *)sp_malloc(length);
+  ASSERT_FALSE(ptr == nullptr);
+  const std::size_t memSz = sp_usable_size(ptr);
+  memset(ptr, 0xef, length);
+
+  // same class or not small enough to be worth the move
+  ASSERT_EQ(ptr, sp_realloc(ptr, memSz - 1));
+  ASSERT_EQ(ptr, sp_realloc(ptr, memSz / 2));
+
+  uint8_t *const shrunk = (uint8_t *)sp_realloc(ptr, 100);
+  ASSERT_FALSE(shrunk == nullptr);
+  ASSERT_NE(ptr, shrunk);
+  ASSERT_TRUE(sp_usable_size(shrunk) >= 100);
+  ASSERT_TRUE(sp_usable_size(shrunk) * SP_MALLOC_SHRINK_FACTOR <= memSz);
+  ASSERT_EQ(uint8_t(0xef), shrunk[0]);
+  ASSERT_EQ(uint8_t(0xef), shrunk[99]);
+  ASSERT_TRUE(sp_free(shrunk));
+}
+
 //-----------------------------------------
 
 // ./test/thetest --gtest_filter="*MallocTest*"
@@ -0,0 +1,214 @@
+#ifndef SP_MALLOC_TREE_H
+#define SP_MALLOC_TREE_H
+
+#include <cassert>
+#include <cstdint>
+
+/*
+ * Intrusive AVL tree. The links and the height are stored in the node and are
+ * accessed through @Tr which is expected to have the members:
+ *
+ *   static T *&left(T *) noexcept;
+ *   static T *&right(T *) noexcept;
+ *   static std::uint8_t &height(T *) noexcept;
+ *   // strict total order, every node in a tree must be unique
+ *   static bool less(const T *, const T *) noexcept;
+ *
+ * Insert and remove are recursive, the depth is bounded by 1.44 * log2(n).
+ */
+namespace tree {
+
+template <typename T, typename Tr>
+std::uint8_t
+height_of(T *const node) noexcept {
+  return node ? Tr::height(node) : std::uint8_t(0);
+} // tree::height_of()
+
+template <typename T, typename Tr>
+void
+update(T *const node) noexcept {
+  const std::uint8_t l = height_of<T, Tr>(Tr::left(node));
+  const std::uint8_t r = height_of<T, Tr>(Tr::right(node));
+  Tr::height(node) = std::uint8_t((l > r ? l : r) + 1);
+} // tree::update()
+
+template <typename T, typename Tr>
+T *
+rotate_right(T *const node) noexcept {
+  T *const result = Tr::left(node);
+  Tr::left(node) = Tr::right(result);
+  Tr::right(result) = node;
+  update<T, Tr>(node);
+  update<T, Tr>(result);
+  return result;
+} // tree::rotate_right()
+
+template <typename T, typename Tr>
+T *
+rotate_left(T *const node) noexcept {
+  T *const result = Tr::right(node);
+  Tr::right(node) = Tr::left(result);
+  Tr::left(result) = node;
+  update<T, Tr>(node);
+  update<T, Tr>(result);
+  return result;
+} // tree::rotate_left()
+
+template <typename T, typename Tr>
+T *
+rebalance(T *const node) noexcept {
+  update<T, Tr>(node);
+  T *const l = Tr::left(node);
+  T *const r = Tr::right(node);
+  const int balance = int(height_of<T, Tr>(l)) - int(height_of<T, Tr>(r));
+
+  if (balance > 1) {
+    if (height_of<T, Tr>(Tr::left(l)) < height_of<T, Tr>(Tr::right(l))) {
+      Tr::left(node) = rotate_left<T, Tr>(l);
+    }
+    return rotate_right<T, Tr>(node);
+  }
+
+  if (balance < -1) {
+    if (height_of<T, Tr>(Tr::right(r)) < height_of<T, Tr>(Tr::left(r))) {
+      Tr::right(node) = rotate_right<T, Tr>(r);
+    }
+    return rotate_left<T, Tr>(node);
+  }
+
+  return node;
+} // tree::rebalance()
+
+/* @return            the new root
+ */
+template <typename T, typename Tr>
+T *
+insert(T *const root, T *const node) noexcept {
+  assert(node);
+  if (!root) {
+    Tr::left(node) = nullptr;
+    Tr::right(node) = nullptr;
+    Tr::height(node) = 1;
+    return node;
+  }
+
+  assert(root != node);
+  if (Tr::less(node, root)) {
+    Tr::left(root) = insert<T, Tr>(Tr::left(root), node);
+  } else {
+    Tr::right(root) = insert<T, Tr>(Tr::right(root), node);
+  }
+  return rebalance<T, Tr>(root);
+} // tree::insert()
+
+template <typename T, typename Tr>
+T *
+remove_min(T *const root, T *&min) noexcept {
+  if (!Tr::left(root)) {
+    min = root;
+    return Tr::right(root);
+  }
+
+  Tr::left(root) = remove_min<T, Tr>(Tr::left(root), min);
+  return rebalance<T, Tr>(root);
+} // tree::remove_min()
+
+/* Remove @node which must be present in the tree.
+ *
+ * @return            the new root
+ */
+template <typename T, typename Tr>
+T *
+remove(T *const root, T *const node) noexcept {
+  assert(node);
+  if (!root) {
+    // not present
+    assert(false);
+    return nullptr;
+  }
+
+  if (Tr::less(node, root)) {
+    Tr::left(root) = remove<T, Tr>(Tr::left(root), node);
+  } else if (Tr::less(root, node)) {
+    Tr::right(root) = remove<T, Tr>(Tr::right(root), node);
+  } else {
+    assert(root == node);
+    T *const l = Tr::left(node);
+    T *const r = Tr::right(node);
+    Tr::left(node) = nullptr;
+    Tr::right(node) = nullptr;
+    if (!r) {
+      return l;
+    }
+
+    T *min = nullptr;
+    T *const rest = remove_min<T, Tr>(r, min);
+    Tr::left(min) = l;
+    Tr::right(min) = rest;
+    return rebalance<T, Tr>(min);
+  }
+
+  return rebalance<T, Tr>(root);
+} // tree::remove()
+
+/* The first node in order where @before(node) is false, @before must be true
+ * for a prefix of the nodes in order.
+ */
+template <typename T, typename Tr, typename F>
+T *
+lower_bound(T *current, F before) noexcept {
+  T *result = nullptr;
+next:
+  if (current) {
+    if (before(current)) {
+      current = Tr::right(current);
+    } else {
+      result = current;
+      current = Tr::left(current);
+    }
+    goto next;
+  }
+  return result;
+} // tree::lower_bound()
+
+/* The last node in order where @before(node) is true.
+ */
+template <typename T, typename Tr, typename F>
+T *
+last_before(T *current, F before) noexcept {
+  T *result = nullptr;
+next:
+  if (current) {
+    if (before(current)) {
+      result = current;
+      current = Tr::right(current);
+    } else {
+      current = Tr::left(current);
+    }
+    goto next;
+  }
+  return result;
+} // tree::last_before()
+
+/* In order traversal, stops when @f returns false.
+ *
+ * @return            false if the traversal was stopped
+ */
+template <typename T, typename Tr, typename F>
+bool
+for_each(T *const current, F &f) noexcept {
+  if (current) {
+    if (!for_each<T, Tr>(Tr::left(current), f)) {
+      return false;
+    }
+    if (!f(current)) {
+      return false;
+    }
+    return for_each<T, Tr>(Tr::right(current), f);
+  }
+  return true;
+} // tree::for_each()
+
+} // namespace tree
+
+#endif
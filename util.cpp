@@ -1,5 +1,6 @@
 #include "util.h"
 #include <cassert>
+#include <time.h> //clock_gettime
 
 /*
  *===========================================================
@@ -9,13 +10,12 @@
 namespace util {
 
 void *
-align_pointer(void *const start, std::uint32_t alignment) noexcept {
+align_pointer(void *const start, std::size_t alignment) noexcept {
   assert(start != nullptr);
   assert(alignment >= 8);
-  assert(alignment % 8 == 0);
+  assert(is_power_of_two(alignment));
   uintptr_t ptr = reinterpret_cast<uintptr_t>(start);
-  uintptr_t diff = ptr + alignment - 1;
-  ptr += diff & alignment;
+  ptr = (ptr + alignment - 1) & ~(alignment - 1);
   return reinterpret_cast<void *>(ptr);
 } // align_pointer()
 
@@ -24,7 +24,6 @@ round_even(std::size_t v) noexcept {
   if (v <= 8) {
     return 8;
   }
-  // TODO support 64 bit word
   // https://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
   // 8,16,32,64,...
   v--;
@@ -33,6 +32,7 @@ round_even(std::size_t v) noexcept {
   v |= v >> 4;
   v |= v >> 8;
   v |= v >> 16;
+  v |= v >> 32;
   v++;
   return v;
 } // round_even()
@@ -65,6 +65,11 @@ leading_zeros(std::size_t n) noexcept {
   return __builtin_clzl(n);
 } // util:leading_zeroes()
 
+bool
+is_power_of_two(std::size_t v) noexcept {
+  return v != 0 && (v & (v - 1)) == 0;
+} // util::is_power_of_two()
+
 std::size_t
 round_up(std::size_t data, std::size_t evenMultiple) noexcept {
   const std::size_t remaining = data % evenMultiple;
@@ -72,4 +77,18 @@ round_up(std::size_t data, std::size_t evenMultiple) noexcept {
   return data + add;
 }
 
+std::size_t
+divide(std::size_t dividend, std::uint32_t reciprocal) noexcept {
+  assert(dividend < (std::uint64_t(1) << 32));
+  return std::size_t((std::uint64_t(dividend) * reciprocal) >> 32);
+} // util::divide()
+
+std::uint64_t
+monotonic_ms() noexcept {
+  struct timespec now;
+  ::clock_gettime(CLOCK_MONOTONIC, &now);
+  return std::uint64_t(now.tv_sec) * 1000 +
+         std::uint64_t(now.tv_nsec) / 1000000;
+} // util::monotonic_ms()
+
 } // namespace util
@@ -13,7 +13,7 @@
  */
 namespace util {
 void *
-align_pointer(void *const start, std::uint32_t alignment) noexcept;
+align_pointer(void *const start, std::size_t alignment) noexcept;
 
 std::size_t
 round_even(std::size_t v) noexcept;
@@ -27,9 +27,33 @@ ptr_diff(void *const first, void *const second) noexcept;
 std::size_t trailing_zeros(std::size_t) noexcept;
 std::size_t leading_zeros(std::size_t) noexcept;
 
+bool
+is_power_of_two(std::size_t) noexcept;
+
 std::size_t
 round_up(std::size_t data, std::size_t eventMultiple) noexcept;
 
+/* Fixed point reciprocal of @divisor, used by divide() to replace a division
+ * with a multiplication and a shift.
+ */
+constexpr std::uint32_t
+reciprocal(std::size_t divisor) noexcept {
+  // ceil(2^32 / divisor)
+  return divisor < 2 ? 0
+                     : std::uint32_t(((std::uint64_t(1) << 32) + divisor - 1) /
+                                     divisor);
+} // util::reciprocal()
+
+/* Exact when @dividend is a multiple of the divisor and less than 2^32.
+ */
+std::size_t
+divide(std::size_t dividend, std::uint32_t reciprocal) noexcept;
+
+/* Milliseconds of a monotonic clock.
+ */
+std::uint64_t
+monotonic_ms() noexcept;
+
 } // namespace util
 
 #endif